@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+#include "article_codec.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FRAME_HEADER_SPACE 6 // Marker and the longest payload length varint
+#define MAX_NESTING 8        // Deepest object/array nesting accepted when decoding
+#define TIMESTAMP_FORMAT "%Y-%m-%dT%H:%M:%SZ"
+#define TIMESTAMP_LENGTH 20
+
+// Tags of encoded values
+#define TAG_NULL 0
+#define TAG_FALSE 1
+#define TAG_TRUE 2
+#define TAG_INT 3      // Zigzag varint
+#define TAG_DOUBLE 4   // 8 bytes, host order
+#define TAG_STRING 5   // Varint length and the bytes
+#define TAG_INTERNED 6 // Varint index into the dictionary
+#define TAG_TIME 7     // Zigzag varint seconds since the epoch, printed as TIMESTAMP_FORMAT
+#define TAG_OBJECT 8   // Varint field count, then key and value per field
+#define TAG_ARRAY 9    // Varint item count, then the values
+
+// Shared dictionary of field names and common values, both sides must agree on it: only ever append to it
+static const char *dictionary[] = {
+    "source", "id", "name", "author", "title", "description", "url", "urlToImage", "publishedAt", "content",
+    "seq", "priority", "key", "forwarded_by",
+    "Reuters", "BBC", "CNN", "reuters", "bbc-news", "cnn",
+    "urgent", "normal", "bulk",
+};
+static const int dictionary_size = sizeof(dictionary) / sizeof(dictionary[0]);
+
+// Data structure for a frame being encoded
+typedef struct
+{
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+} Encoder;
+
+// Data structure for a frame being decoded
+typedef struct
+{
+    const unsigned char *next;
+    const unsigned char *end;
+    int failed; // Set once the frame turned out to be truncated or malformed
+} Decoder;
+
+// Function to find a string in the dictionary, -1 if it isn't in it
+static int find_interned(const char *string)
+{
+    for (int i = 0; i < dictionary_size; i++)
+    {
+        if (strcmp(dictionary[i], string) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to append bytes to a frame being encoded
+static void put_bytes(Encoder *encoder, const void *bytes, size_t length)
+{
+    if (encoder->length + length > encoder->capacity)
+    {
+        while (encoder->length + length > encoder->capacity)
+        {
+            encoder->capacity *= 2;
+        }
+        encoder->data = realloc(encoder->data, encoder->capacity);
+    }
+    memcpy(encoder->data + encoder->length, bytes, length);
+    encoder->length += length;
+}
+
+// Function to write an unsigned varint (7 bits per byte, low bits first) to a buffer, returns its length
+static int write_varint(unsigned char *out, uint64_t value)
+{
+    int length = 0;
+    while (value >= 0x80)
+    {
+        out[length++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[length++] = value;
+    return length;
+}
+
+// Function to append an unsigned varint to a frame being encoded
+static void put_varint(Encoder *encoder, uint64_t value)
+{
+    unsigned char bytes[10];
+    put_bytes(encoder, bytes, write_varint(bytes, value));
+}
+
+// Function to append a signed integer as a zigzag varint, so small negative numbers stay short
+static void put_signed(Encoder *encoder, long long value)
+{
+    put_varint(encoder, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+// Function to append a string, as a dictionary index if it is interned
+static void put_string(Encoder *encoder, const char *string, int allow_interned)
+{
+    int index = allow_interned ? find_interned(string) : -1;
+    if (index >= 0)
+    {
+        unsigned char tag = TAG_INTERNED;
+        put_bytes(encoder, &tag, 1);
+        put_varint(encoder, index);
+        return;
+    }
+    size_t length = strlen(string);
+    unsigned char tag = TAG_STRING;
+    put_bytes(encoder, &tag, 1);
+    put_varint(encoder, length);
+    put_bytes(encoder, string, length);
+}
+
+// Function to parse a timestamp like "2024-11-13T16:34:06Z", only if printing it back yields the same string
+int article_parse_timestamp(const char *string, long long *seconds)
+{
+    struct tm parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    if (strlen(string) != TIMESTAMP_LENGTH)
+    {
+        return 0;
+    }
+    const char *rest = strptime(string, TIMESTAMP_FORMAT, &parsed);
+    if (rest == NULL || *rest != '\0')
+    {
+        return 0;
+    }
+
+    time_t time = timegm(&parsed);
+    struct tm printed;
+    char check[TIMESTAMP_LENGTH + 1];
+    if (gmtime_r(&time, &printed) == NULL || strftime(check, sizeof(check), TIMESTAMP_FORMAT, &printed) != TIMESTAMP_LENGTH ||
+        strcmp(check, string) != 0)
+    {
+        return 0;
+    }
+    *seconds = time;
+    return 1;
+}
+
+static void put_value(Encoder *encoder, const cJSON *value);
+
+// Function to append the fields of an object
+static void put_object(Encoder *encoder, const cJSON *object)
+{
+    put_varint(encoder, cJSON_GetArraySize(object));
+    for (const cJSON *field = object->child; field != NULL; field = field->next)
+    {
+        // Keys are a dictionary index plus one, or 0 followed by the key itself
+        int index = find_interned(field->string);
+        put_varint(encoder, index + 1);
+        if (index < 0)
+        {
+            size_t length = strlen(field->string);
+            put_varint(encoder, length);
+            put_bytes(encoder, field->string, length);
+        }
+        put_value(encoder, field);
+    }
+}
+
+// Function to append a tagged value
+static void put_value(Encoder *encoder, const cJSON *value)
+{
+    unsigned char tag;
+    long long seconds;
+
+    if (cJSON_IsString(value))
+    {
+        if (article_parse_timestamp(value->valuestring, &seconds))
+        {
+            tag = TAG_TIME;
+            put_bytes(encoder, &tag, 1);
+            put_signed(encoder, seconds);
+        }
+        else
+        {
+            put_string(encoder, value->valuestring, 1);
+        }
+    }
+    else if (cJSON_IsNumber(value))
+    {
+        double number = value->valuedouble;
+        if (number >= -9e15 && number <= 9e15 && number == (double)(long long)number)
+        {
+            tag = TAG_INT;
+            put_bytes(encoder, &tag, 1);
+            put_signed(encoder, (long long)number);
+        }
+        else
+        {
+            tag = TAG_DOUBLE;
+            put_bytes(encoder, &tag, 1);
+            put_bytes(encoder, &number, sizeof(number));
+        }
+    }
+    else if (cJSON_IsObject(value))
+    {
+        tag = TAG_OBJECT;
+        put_bytes(encoder, &tag, 1);
+        put_object(encoder, value);
+    }
+    else if (cJSON_IsArray(value))
+    {
+        tag = TAG_ARRAY;
+        put_bytes(encoder, &tag, 1);
+        put_varint(encoder, cJSON_GetArraySize(value));
+        for (const cJSON *item = value->child; item != NULL; item = item->next)
+        {
+            put_value(encoder, item);
+        }
+    }
+    else
+    {
+        tag = cJSON_IsTrue(value) ? TAG_TRUE : cJSON_IsFalse(value) ? TAG_FALSE : TAG_NULL;
+        put_bytes(encoder, &tag, 1);
+    }
+}
+
+// Function to encode an article as a binary frame
+unsigned char *article_encode(const cJSON *article, size_t *length)
+{
+    if (!cJSON_IsObject(article))
+    {
+        return NULL;
+    }
+
+    // Encode the payload after room for the header, whose length varint is only known afterwards
+    Encoder encoder;
+    encoder.capacity = 512;
+    encoder.data = malloc(encoder.capacity);
+    encoder.length = FRAME_HEADER_SPACE;
+    put_object(&encoder, article);
+
+    size_t payload_length = encoder.length - FRAME_HEADER_SPACE;
+    if (payload_length > ARTICLE_MAX_FRAME)
+    {
+        free(encoder.data);
+        return NULL;
+    }
+    unsigned char header[FRAME_HEADER_SPACE];
+    header[0] = ARTICLE_FRAME_MARKER;
+    int header_length = 1 + write_varint(header + 1, payload_length);
+    size_t start = FRAME_HEADER_SPACE - header_length;
+    memcpy(encoder.data + start, header, header_length);
+    memmove(encoder.data, encoder.data + start, header_length + payload_length);
+
+    *length = header_length + payload_length;
+    return encoder.data;
+}
+
+// Function to read an unsigned varint, marking the decoder failed if it runs past the end
+static uint64_t get_varint(Decoder *decoder)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (decoder->next == decoder->end)
+        {
+            break;
+        }
+        unsigned char byte = *decoder->next++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return value;
+        }
+    }
+    decoder->failed = 1;
+    return 0;
+}
+
+// Function to read a zigzag varint
+static long long get_signed(Decoder *decoder)
+{
+    uint64_t value = get_varint(decoder);
+    return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+// Function to read a length-prefixed string, returned as a new terminated copy (NULL if it doesn't fit the frame)
+static char *get_string(Decoder *decoder)
+{
+    uint64_t length = get_varint(decoder);
+    if (decoder->failed || length > (uint64_t)(decoder->end - decoder->next))
+    {
+        decoder->failed = 1;
+        return NULL;
+    }
+    char *string = malloc(length + 1);
+    memcpy(string, decoder->next, length);
+    string[length] = '\0';
+    decoder->next += length;
+    return string;
+}
+
+static cJSON *get_object(Decoder *decoder, int depth);
+
+// Function to read a tagged value
+static cJSON *get_value(Decoder *decoder, int depth)
+{
+    if (decoder->next == decoder->end || depth > MAX_NESTING)
+    {
+        decoder->failed = 1;
+        return NULL;
+    }
+
+    unsigned char tag = *decoder->next++;
+    switch (tag)
+    {
+    case TAG_NULL:
+        return cJSON_CreateNull();
+    case TAG_FALSE:
+        return cJSON_CreateFalse();
+    case TAG_TRUE:
+        return cJSON_CreateTrue();
+    case TAG_INT:
+        return cJSON_CreateNumber((double)get_signed(decoder));
+    case TAG_DOUBLE:
+    {
+        double number;
+        if (decoder->end - decoder->next < (long)sizeof(number))
+        {
+            decoder->failed = 1;
+            return NULL;
+        }
+        memcpy(&number, decoder->next, sizeof(number));
+        decoder->next += sizeof(number);
+        return cJSON_CreateNumber(number);
+    }
+    case TAG_STRING:
+    {
+        char *string = get_string(decoder);
+        cJSON *value = string != NULL ? cJSON_CreateString(string) : NULL;
+        free(string);
+        return value;
+    }
+    case TAG_INTERNED:
+    {
+        uint64_t index = get_varint(decoder);
+        if (decoder->failed || index >= (uint64_t)dictionary_size)
+        {
+            decoder->failed = 1;
+            return NULL;
+        }
+        return cJSON_CreateString(dictionary[index]);
+    }
+    case TAG_TIME:
+    {
+        time_t time = get_signed(decoder);
+        struct tm printed;
+        char string[TIMESTAMP_LENGTH + 1];
+        if (gmtime_r(&time, &printed) == NULL || strftime(string, sizeof(string), TIMESTAMP_FORMAT, &printed) == 0)
+        {
+            decoder->failed = 1;
+            return NULL;
+        }
+        return cJSON_CreateString(string);
+    }
+    case TAG_OBJECT:
+        return get_object(decoder, depth + 1);
+    case TAG_ARRAY:
+    {
+        uint64_t count = get_varint(decoder);
+        cJSON *array = cJSON_CreateArray();
+        for (uint64_t i = 0; i < count && !decoder->failed; i++)
+        {
+            cJSON *item = get_value(decoder, depth + 1);
+            if (item != NULL)
+            {
+                cJSON_AddItemToArray(array, item);
+            }
+        }
+        return array;
+    }
+    default:
+        decoder->failed = 1;
+        return NULL;
+    }
+}
+
+// Function to read the fields of an object
+static cJSON *get_object(Decoder *decoder, int depth)
+{
+    uint64_t count = get_varint(decoder);
+    cJSON *object = cJSON_CreateObject();
+    for (uint64_t i = 0; i < count && !decoder->failed; i++)
+    {
+        uint64_t key = get_varint(decoder);
+        char *literal = NULL;
+        if (key == 0)
+        {
+            literal = get_string(decoder);
+        }
+        else if (key > (uint64_t)dictionary_size)
+        {
+            decoder->failed = 1;
+        }
+        if (decoder->failed)
+        {
+            break;
+        }
+
+        cJSON *value = get_value(decoder, depth);
+        if (value != NULL)
+        {
+            cJSON_AddItemToObject(object, literal != NULL ? literal : dictionary[key - 1], value);
+        }
+        free(literal);
+    }
+    return object;
+}
+
+// Function to find the length of the binary frame at the start of a buffer
+long article_frame_length(const unsigned char *data, size_t available)
+{
+    if (available == 0 || data[0] != ARTICLE_FRAME_MARKER)
+    {
+        return available == 0 ? 0 : -1;
+    }
+
+    uint64_t payload_length = 0;
+    for (size_t i = 1; i < available && i < FRAME_HEADER_SPACE; i++)
+    {
+        payload_length |= (uint64_t)(data[i] & 0x7F) << (7 * (i - 1));
+        if (!(data[i] & 0x80))
+        {
+            if (payload_length > ARTICLE_MAX_FRAME)
+            {
+                return -1;
+            }
+            long length = i + 1 + payload_length;
+            return (size_t)length <= available ? length : 0;
+        }
+    }
+    return available < FRAME_HEADER_SPACE ? 0 : -1;
+}
+
+// Function to decode a binary frame back into the article, NULL if it is malformed
+cJSON *article_decode(const unsigned char *frame, size_t length)
+{
+    long frame_length = article_frame_length(frame, length);
+    if (frame_length <= 0)
+    {
+        return NULL;
+    }
+
+    Decoder decoder;
+    decoder.end = frame + frame_length;
+    decoder.next = frame + 1;
+    decoder.failed = 0;
+    get_varint(&decoder); // Payload length, already checked
+    cJSON *article = get_object(&decoder, 0);
+    if (decoder.failed || decoder.next != decoder.end)
+    {
+        cJSON_Delete(article);
+        return NULL;
+    }
+    return article;
+}
+
+// Function to check whether the user asked the clients for binary frames (NEWS_ENCODING=binary)
+int article_binary_requested()
+{
+    const char *encoding = getenv(ARTICLE_ENCODING_ENV);
+    return encoding != NULL && strcmp(encoding, "binary") == 0;
+}
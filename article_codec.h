@@ -0,0 +1,35 @@
+#ifndef ARTICLE_CODEC_H
+#define ARTICLE_CODEC_H
+
+#include <stddef.h>
+#include <cjson/cJSON.h>
+
+#define ARTICLE_FRAME_MARKER 0x00         // First byte of a binary article frame (text lines never start with a NUL)
+#define ARTICLE_MAX_FRAME (1 << 20)       // Frames claiming to be longer than this are rejected as corrupt
+#define ARTICLE_ENCODING_ENV "NEWS_ENCODING" // Set to "binary" to make the clients exchange binary frames
+
+// Binary article encoding, used on the wire next to newline-delimited JSON
+// A frame is the marker byte, the payload length (varint) and the payload. The payload is an object: a varint field
+// count, then per field its key and a tagged value. Keys and short strings found in the shared dictionary (field names
+// of news_articles.json, the topic sources) are sent as dictionary indexes, other strings are length-prefixed,
+// integers are zigzag varints and "publishedAt"-style timestamps are varint seconds since the epoch
+
+// Function to encode an article as a binary frame
+// Returns the frame (to be freed by the caller) and sets its length, or NULL if the article can't be encoded
+unsigned char *article_encode(const cJSON *article, size_t *length);
+
+// Function to find the length of the binary frame at the start of a buffer
+// Returns 0 if the buffer doesn't hold the whole frame yet, -1 if it isn't a valid frame
+long article_frame_length(const unsigned char *data, size_t available);
+
+// Function to decode a binary frame back into the article, NULL if it is malformed
+cJSON *article_decode(const unsigned char *frame, size_t length);
+
+// Function to parse a timestamp like "2024-11-13T16:34:06Z" into seconds since the epoch
+// Returns 0 unless it is in exactly that form (printing it back yields the same string)
+int article_parse_timestamp(const char *string, long long *seconds);
+
+// Function to check whether the user asked the clients for binary frames (NEWS_ENCODING=binary)
+int article_binary_requested();
+
+#endif
@@ -4,35 +4,141 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <cjson/cJSON.h>
-#include <sys/epoll.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include "partition_map.h"
+#include "io_backend.h"
+#include "shm_transport.h"
+#include "article_codec.h"
+#include "search_index.h"
 
 #define MAX_TOPICS 3
 #define MAX_SUBSCRIBERS 100
 #define MAX_DATA 512
 #define MAX_BUFFER_SIZE 8192
-#define PORT_SUBSCRIBER 8080
-#define PORT_PUBLISHER 8081
-#define MAX_EVENTS 10
+#define MAX_DURABLE_SUBSCRIPTIONS 50
+#define MAX_NAME_LENGTH 64
+#define WAIT_TIMEOUT_MS 100
+#define MAX_CONSUMER_GROUPS 10
+#define MAX_GROUP_MEMBERS 20
+#define MAX_GROUP_SEND_BATCH 64
+#define MAX_COALESCE_FRAMES 256          // Articles a subscriber's pending batch holds before it must be flushed
+#define COALESCE_MAX_BYTES (256 * 1024)  // Bytes a subscriber's pending batch holds before it must be flushed
+#define RATE_SMOOTHING 0.2               // Weight of the latest observation in a subscriber's article rate
+#define SEGMENT_DIR "segments"
+#define REPLAY_MIN_ARTICLES 8 // Backlogs at least this long are replayed from the topic's segment file
+#define MAX_INGEST_QUEUE 256  // Articles waiting to be routed per priority lane
+#define LANE_QUANTUM 64       // Articles sent from a lane each time the scheduler picks it
+#define LATENCY_BUCKETS 32    // Power-of-two microsecond buckets of the delivery latency histogram
+#define QUERY_PAGE_SIZE 32    // Articles per page of a query's results
+#define MAX_FORWARD_QUEUE 2048 // Articles waiting to be forwarded per broker (room for every stored article)
+#define FORWARD_SEND_TIMEOUT_S 5 // How long a send to another broker may block before that broker counts as unreachable
+#define REPLICATION_ACK_TIMEOUT_MS 2000 // How long commits wait for a follower whose replication stream is down
+#define FENCED_RETRY_S 10             // How often a fenced leader checks whether its follower accepts it again
+#define LEADER_PROBE_TIMEOUT_S 1      // How long a follower waits for a leader it probes to answer
 
-// Data structure for a subscriber
+// Delivery states of an article within a consumer group
+#define DELIVERY_UNASSIGNED 0 // Not yet given to any member
+#define DELIVERY_ASSIGNED 1   // Given to a member, not yet sent
+#define DELIVERY_SENT 2       // Sent to its member, waiting for the ack
+#define DELIVERY_ACKED 3      // Acknowledged by its member
+
+// Data structure for a named durable subscription, which outlives the connection that created it
 typedef struct
 {
-    int sockfd;               // Acts as identifier for the subscriber
-    char *topics[MAX_TOPICS]; // Topic names to which the subscriber has subscribed to
-    int topic_count;          // No of topics to which this subscriber has subscribed to
-    pthread_cond_t cond;      // Condition variable for waiting for data in subscribed topics
+    char name[MAX_NAME_LENGTH]; // Name chosen by the client, used to resume the subscription
+    int acked_seq[MAX_TOPICS];  // Last sequence number acknowledged for each topic (indexed like topics[])
+    int active[MAX_TOPICS];     // Whether a subscriber connection currently consumes each topic (indexed like topics[])
+} DurableSubscription;
+
+typedef struct ConsumerGroup ConsumerGroup;
+
+// Data structure for a subscriber
+typedef struct Subscriber
+{
+    int sockfd;                   // Acts as identifier for the subscriber
+    char *topics[MAX_TOPICS];     // Topic names to which the subscriber has subscribed to
+    int topic_count;              // No of topics to which this subscriber has subscribed to
+    pthread_cond_t cond;          // Condition variable for waiting for data in subscribed topics
+    DurableSubscription *durable; // Durable subscription this connection resumes, NULL if ephemeral
+    ConsumerGroup *group;         // Consumer group this subscriber is a member of, NULL if none
+    int outstanding;              // No of group articles assigned to this member and not yet acked
+    int next_index[MAX_TOPICS];   // Index of the next article to send for each subscribed topic
+    char inbuf[MAX_BUFFER_SIZE];  // Partially received control lines (acks) from the subscriber
+    int inbuf_len;                // No of bytes buffered in inbuf
+    IoSender *sender;             // Writes batches of articles to the subscriber socket
+    int lane_credits[PRIORITY_CLASSES]; // Quanta each priority lane may still send before the credits are refilled
+    int lane_cursor;              // Subscribed topic to try first within a lane (round-robin)
+    long long subscribed_us;      // When the subscription started; only articles received after it count towards latency
+    char *pending[MAX_COALESCE_FRAMES];             // Serialized articles waiting to be written as one batch
+    struct iovec pending_iov[MAX_COALESCE_FRAMES];  // The pending articles as they are written
+    struct Topic *pending_topic[MAX_COALESCE_FRAMES]; // Topic and index of each pending article, for the latency stats
+    int pending_index[MAX_COALESCE_FRAMES];
+    int pending_count;            // No of pending articles
+    size_t pending_bytes;         // Size of the pending batch
+    long long pending_since_us;   // When the oldest pending article was queued
+    int pending_urgent;           // Whether an urgent article is pending (it is written right away)
+    int budget_us;                // How long articles may be held back to batch them, 0 for low-latency mode
+    int cork;                     // Whether batches are corked (TCP_CORK) until the subscriber is caught up
+    int corked;                   // Whether TCP_CORK is currently set
+    double article_rate;          // Observed articles per second (moving average), sizes the batches
+    long long last_flush_us;      // When the last batch was written
+    ShmRing *ring;                // Shared-memory ring articles are written to for a local subscriber, NULL over TCP
+    int binary;                   // Whether articles are sent as binary frames (article_codec.h) rather than JSON lines
 } Subscriber;
 
-// Data structure for a topic
+// Assignment strategy of a consumer group: picks which of the candidate members gets an article
 typedef struct
+{
+    const char *name;
+    int (*assign)(ConsumerGroup *group, Subscriber **candidates, int candidate_count, cJSON *article);
+} AssignmentStrategy;
+
+// Data structure for a consumer group, whose members share the articles of their topics
+// Each article is delivered to exactly one member; delivery state outlives member connections
+struct ConsumerGroup
+{
+    char name[MAX_NAME_LENGTH];                  // Name chosen by the clients joining the group
+    const AssignmentStrategy *strategy;          // How articles are spread across members
+    Subscriber *members[MAX_GROUP_MEMBERS];      // Currently connected members
+    int member_count;                            // No of connected members
+    int next_member;                             // Round-robin cursor
+    Subscriber *owner[MAX_TOPICS][MAX_DATA];     // Member each article is assigned to (indexed like topics[])
+    unsigned char state[MAX_TOPICS][MAX_DATA];   // DELIVERY_* state of each article
+    int acked_below[MAX_TOPICS];                 // Every article below this index has been acked
+    pthread_mutex_t mutex;                       // Mutex for locking group operations
+};
+
+// Data structure for a topic
+typedef struct Topic
 {
     char *name;                               // Name of topic
     Subscriber *subscribers[MAX_SUBSCRIBERS]; // List of subscribers
     int subscriber_count;                     // Count of subscribers subscribed to this topic
     cJSON *data[MAX_DATA];                    // Data (news articles) for this topic
     int data_count;                           // No of data items in a specific topic
+    int committed_count;                      // No of data items replicated as the ack mode requires, and deliverable
+    int segment_fd;                           // Append-only file of the stored articles as sent on the wire, -1 if unavailable
+    off_t offsets[MAX_DATA + 1];              // Offset of each stored article in the segment file, and of its end
+    int priority;                             // Priority class (PRIORITY_*) of the topic's articles
+    unsigned char priority_of[MAX_DATA];      // Priority class of each stored article
+    long long received_us[MAX_DATA];          // When each stored article reached this broker
+    unsigned char *frames[MAX_DATA];          // Each stored article encoded once as a binary frame, NULL if it couldn't be
+    size_t frame_length[MAX_DATA];
+    SearchIndex search;                       // Time and term index of the stored articles, answers queries
+    int generation;                           // Bumped whenever the stored articles are dropped (the topic moved away)
+    cJSON *retired[MAX_DATA];                 // Articles dropped the last time the topic moved away, and their frames
+    unsigned char *retired_frames[MAX_DATA];  // (threads serving them may still read them without the lock)
+    int retired_count;
     pthread_mutex_t mutex;                    // Mutex for locking topic operations
     pthread_cond_t cond;                      // Condition variable for waiting for new data
 } Topic;
@@ -42,6 +148,104 @@ int topic_count = 0;
 int publisher_done = 0;
 pthread_mutex_t topic_mutex[MAX_TOPICS]; // Mutex array for each topic
 
+DurableSubscription durable_subscriptions[MAX_DURABLE_SUBSCRIPTIONS]; // Named subscriptions and their acked offsets
+int durable_count = 0;
+pthread_mutex_t durable_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects durable_subscriptions
+
+ConsumerGroup consumer_groups[MAX_CONSUMER_GROUPS]; // Consumer groups and their delivery state
+int consumer_group_count = 0;
+pthread_mutex_t consumer_groups_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects consumer_groups[] creation
+
+// Partitioning of the topics across broker instances
+PartitionMap partition_map;                                   // Which broker owns which topic
+const char *partition_map_file = PARTITION_MAP_FILE;          // File the partition map is (re)loaded from
+int broker_id = 0;                                            // Id of this broker in the partition map
+int topic_owned[MAX_TOPICS];                                  // Whether this broker owns each topic (indexed like topics[])
+pthread_mutex_t partition_mutex = PTHREAD_MUTEX_INITIALIZER;  // Protects partition_map, topic_owned is written under it
+volatile sig_atomic_t reload_requested = 0;                   // Set by SIGHUP to reload the partition map
+
+// Data structure for the articles waiting to be forwarded to another broker
+// Each broker gets a thread of its own sending them, so no network I/O happens while a topic mutex is held
+typedef struct
+{
+    char *lines[MAX_FORWARD_QUEUE];    // Articles as sent: newline-terminated and marked with "forwarded_by"
+    size_t lengths[MAX_FORWARD_QUEUE];
+    int head;                          // Index of the oldest queued article
+    int count;                         // No of queued articles
+    int started;                       // Whether the forwarding thread runs
+    int sockfd;                        // Connection to the broker, -1 if closed (only used by the forwarding thread)
+    pthread_cond_t cond;               // Signalled when articles are queued or taken
+} ForwardQueue;
+
+ForwardQueue forward_queues[MAX_BROKERS];                     // Articles to forward to other brokers (indexed by broker id)
+pthread_mutex_t forward_mutex = PTHREAD_MUTEX_INITIALIZER;    // Protects forward_queues
+
+// Data structure for the replication stream from this broker (the leader) to one of its followers
+typedef struct
+{
+    BrokerAddress address;       // Follower to replicate to
+    int sockfd;                  // Replication stream, -1 while disconnected
+    int sent_count[MAX_TOPICS];  // No of articles of each topic sent on the stream
+    int acked_count[MAX_TOPICS]; // No of articles of each topic the follower confirmed it stored
+    int sent_generation[MAX_TOPICS]; // Generation of each topic the counts refer to
+    int connected;               // Whether the replication stream is up (accessed atomically)
+    long long down_since_us;     // When the replication stream went down (under replication_mutex)
+    int refused;                 // Whether the follower took this broker's topics over (under partition_mutex)
+} Follower;
+
+// Replication of the owned topics to followers, and takeover of a failed leader
+Follower followers[MAX_BROKERS];                               // Followers of this broker
+int follower_count = 0;
+int ack_mode = ACK_MODE_ASYNC;                                 // When an article may be delivered (ACK_MODE_*)
+pthread_mutex_t replication_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects followers' counts
+int promoted[MAX_BROKERS];                                     // Leaders whose topics this broker took over (indexed by broker id)
+int replication_streams[MAX_BROKERS];                          // Replication streams open from each leader (indexed by broker id)
+int watched_leaders[MAX_BROKERS];                              // Leaders whose stream broke, checked before taking them over
+int fenced = 0;                                                // Whether a follower took this broker's topics over
+
+// An article waiting in its ingest lane to be routed
+typedef struct
+{
+    cJSON *article;
+    int topic_index;
+    int forwarded;        // Whether another broker forwarded it (it is stored, never forwarded again)
+    int priority;         // Priority class (PRIORITY_*) of the article
+    long long received_us; // When the article reached this broker
+} IngestItem;
+
+// Data structure for an ingest lane: a ring of articles of one priority class waiting to be routed
+typedef struct
+{
+    IngestItem items[MAX_INGEST_QUEUE];
+    int head;  // Index of the oldest queued article
+    int count; // No of queued articles
+} IngestLane;
+
+// Per-class delivery latency, from reaching the broker to being sent to a subscriber
+typedef struct
+{
+    unsigned long delivered;                 // No of live deliveries measured
+    long long total_us;                      // Sum of their latencies
+    long long max_us;                        // Highest latency seen
+    unsigned long buckets[LATENCY_BUCKETS];  // Deliveries by latency, bucket i holding latencies below 2^i us
+} LatencyStats;
+
+// Priority lanes: articles are queued per class at ingest and sent per class to each subscriber
+// Each time a lane is picked it may send LANE_QUANTUM articles; the weights say how many quanta it gets per round
+int lane_weights[PRIORITY_CLASSES] = {8, 4, 1};
+IngestLane ingest_lanes[PRIORITY_CLASSES];
+int ingest_credits[PRIORITY_CLASSES];                     // Articles each ingest lane may still route this round
+int ingest_pending = 0;                                   // Articles queued or being routed
+pthread_mutex_t ingest_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the ingest lanes
+pthread_cond_t ingest_cond = PTHREAD_COND_INITIALIZER;    // Signalled when articles are queued or routed
+LatencyStats latency_stats[PRIORITY_CLASSES];
+pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects latency_stats
+
+// Broker-wide signal that new data was published, replicated, or the publisher finished
+pthread_mutex_t new_data_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t new_data_cond = PTHREAD_COND_INITIALIZER;
+unsigned long data_generation = 0; // Bumped on every signal, so waiters can't miss one
+
 void printTopicsWithDetails(Topic *topics)
 {
     for (int i = 0; i < topic_count; i++)
@@ -85,340 +289,2789 @@ void destroy_topic_mutexes_and_cond()
     }
 }
 
-// Function to add a new subscriber to a topic
-void add_subscriber_to_topic(Topic *topic, Subscriber *subscriber)
+// Function to find the index of a topic in topics[] by name, -1 if it doesn't exist
+int find_topic_index(const char *name)
 {
-    pthread_mutex_lock(&topic->mutex);
-    if (topic->subscriber_count < MAX_SUBSCRIBERS)
+    for (int i = 0; i < topic_count; i++)
     {
-        topic->subscribers[topic->subscriber_count++] = subscriber;
+        if (strcmp(topics[i].name, name) == 0)
+        {
+            return i;
+        }
     }
-    pthread_mutex_unlock(&topic->mutex);
+    return -1;
 }
 
-// Function to add new data to a topic
-void add_data_to_topic(Topic *topic, cJSON *data)
+// Function to create an empty segment file for each topic (stored articles only live as long as the broker)
+void open_topic_segments()
 {
-    pthread_mutex_lock(&topic->mutex);
-    if (topic->data_count < MAX_DATA)
+    mkdir(SEGMENT_DIR, 0755);
+    for (int i = 0; i < topic_count; i++)
     {
-        topic->data[topic->data_count] = data;
-        topic->data_count++;
+        char path[256];
+        snprintf(path, sizeof(path), "%s/broker-%d-%s.log", SEGMENT_DIR, broker_id, topics[i].name);
+        topics[i].segment_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (topics[i].segment_fd < 0)
+        {
+            perror("Failed to open topic segment, history will be re-serialized");
+        }
+        topics[i].offsets[0] = 0;
     }
-    // pthread_cond_broadcast(&topic->cond); // Wake up waiting subscribers
-    pthread_mutex_unlock(&topic->mutex);
 }
 
-// Function to process received data (extract topic and forward to relevant subscribers)
-void process_data_from_publisher(const char *json_data)
+// Function to append a newly stored article to its topic's segment, framed exactly as it is sent
+// Must be called with the topic mutex held, right after the article was stored at data[data_count - 1]
+void append_to_segment(Topic *topic)
 {
-    cJSON *root = cJSON_Parse(json_data);
-    if (root == NULL)
+    int index = topic->data_count - 1;
+    if (topic->segment_fd < 0)
     {
-        fprintf(stderr, "Error parsing JSON\n");
         return;
     }
 
-    cJSON *source = cJSON_GetObjectItem(root, "source");
-    if (source == NULL)
+    char *json_str = cJSON_PrintUnformatted(topic->data[index]);
+    if (json_str == NULL)
     {
-        fprintf(stderr, "No source found in JSON\n");
-        cJSON_Delete(root);
+        // The segment would miss this article, later reads re-serialize the articles instead
+        fprintf(stderr, "Failed to serialize article for topic segment\n");
+        close(topic->segment_fd);
+        topic->segment_fd = -1;
         return;
     }
+    size_t len = strlen(json_str);
+    json_str[len] = '\n'; // Overwrite the terminator, the line is written by length
+    ssize_t written = write(topic->segment_fd, json_str, len + 1);
+    free(json_str);
 
-    cJSON *name = cJSON_GetObjectItem(source, "name");
-    if (name == NULL)
+    if (written != (ssize_t)(len + 1))
     {
-        fprintf(stderr, "No name found in source\n");
-        cJSON_Delete(root);
+        // A torn segment can't be replayed from anymore, later reads re-serialize the articles
+        perror("Failed to append to topic segment");
+        close(topic->segment_fd);
+        topic->segment_fd = -1;
         return;
     }
+    topic->offsets[index + 1] = topic->offsets[index] + len + 1;
+}
 
-    // Find the topic based on the name provided by the publisher
-    Topic *topic = NULL;
-    for (int i = 0; i < topic_count; i++)
+// Function to encode a newly stored article as a binary frame, so binary subscribers share one encoding
+// Must be called with the topic mutex held, right after the article was stored at data[data_count - 1]
+void encode_stored_article(Topic *topic)
+{
+    int index = topic->data_count - 1;
+    topic->frames[index] = article_encode(topic->data[index], &topic->frame_length[index]);
+}
+
+// Function to send a range of a topic's segment file to a socket without copying it through the broker
+// The stored bytes already hold the newline framing; returns 0 if the socket can no longer be written to
+int send_from_segment(int sockfd, int segment_fd, off_t start, off_t end)
+{
+    while (start < end)
     {
-        if (strcmp(topics[i].name, name->valuestring) == 0)
+        ssize_t sent = sendfile(sockfd, segment_fd, &start, end - start);
+        if (sent < 0 && errno == EINTR)
         {
-            topic = &topics[i];
-            break;
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return 0;
         }
     }
+    return 1;
+}
 
-    // If the topic doesn't exist, print an error and do nothing
-    if (topic == NULL)
-    {
-        fprintf(stderr, "Topic '%s' does not exist. No data will be added.\n", name->valuestring);
-        cJSON_Delete(root); // Clean up the JSON object
-        return;
-    }
-
-    // Add the data to the topic
-    add_data_to_topic(topic, root); // Store the data under the correct topic
+// Function to wake up every subscriber thread waiting for new data
+void notify_new_data()
+{
+    pthread_mutex_lock(&new_data_mutex);
+    data_generation++;
+    pthread_cond_broadcast(&new_data_cond);
+    pthread_mutex_unlock(&new_data_mutex);
 }
 
-// Function to handle incoming connections from the publisher
-void *handle_publisher(void *arg)
+// Function to get the current data generation, to be passed to wait_for_new_data after checking for data
+unsigned long get_data_generation()
 {
-    int publisher_sockfd = *((int *)arg);
-    char buffer[MAX_BUFFER_SIZE];
-    int bytes_received;
+    pthread_mutex_lock(&new_data_mutex);
+    unsigned long generation = data_generation;
+    pthread_mutex_unlock(&new_data_mutex);
+    return generation;
+}
 
-    // Receive and process data from the publisher
-    while ((bytes_received = recv(publisher_sockfd, buffer, sizeof(buffer) - 1, 0)) > 0)
+// Function to wait at most timeout_us until new data is signalled after the given generation, so acks can still be polled meanwhile
+void wait_for_new_data(unsigned long seen_generation, long timeout_us)
+{
+    if (timeout_us <= 0)
     {
-        buffer[bytes_received] = '\0'; // Null-terminate the received string
-        printf("Received data from publisher: %s\n", buffer);
-        process_data_from_publisher(buffer); // Process the data and forward to relevant topics/subscribers
+        return;
     }
 
-    // Publisher disconnected
-    printf("Publisher disconnected\n");
+    struct timeval now;
+    struct timespec deadline;
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout_us / 1000000;
+    deadline.tv_nsec = (now.tv_usec + timeout_us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
 
-    // Notify all subscribers about the new data
-    for (int i = 0; i < topic_count; i++)
+    pthread_mutex_lock(&new_data_mutex);
+    while (data_generation == seen_generation)
     {
-        // Subscriber *subscriber = topics->subscribers[i];
-        // Wake up the subscriber's waiting thread
-        Topic *topic = &topics[i];
-        pthread_cond_signal(&topic->cond);
+        if (pthread_cond_timedwait(&new_data_cond, &new_data_mutex, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
     }
+    pthread_mutex_unlock(&new_data_mutex);
+}
 
-    publisher_done = 1;
-    close(publisher_sockfd);
-    return NULL;
+// Function to get the current time in microseconds
+long long now_us()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (long long)now.tv_sec * 1000000 + now.tv_usec;
 }
 
-// Function to handle the subscription request from the subscriber
-void request_subscription(Subscriber *subscriber, char *buffer)
+// Function to pick the priority lane to serve next: the most urgent lane with work and credit left, -1 if none has work
+// Credits are refilled from lane_weights once every lane with work has used up its share, so lower lanes can't starve
+int pick_lane(int credits[PRIORITY_CLASSES], const int has_work[PRIORITY_CLASSES])
 {
-    // Parse the topics and add the subscriber to those topics
-    char *token = strtok(buffer, ",");
-    while (token != NULL)
+    for (int refill = 0; refill < 2; refill++)
     {
-        for (int i = 0; i < topic_count; i++)
+        for (int c = 0; c < PRIORITY_CLASSES; c++)
         {
-            if (strcmp(topics[i].name, token) == 0)
+            if (has_work[c] && credits[c] > 0)
             {
-                // Add the subscriber to the topic
-                add_subscriber_to_topic(&topics[i], subscriber);
-                // Store the topic in the subscriber's list of topics
-                subscriber->topics[subscriber->topic_count++] = topics[i].name;
-                printf("Subscriber subscribed to topic: %s\n", token);
+                credits[c]--;
+                return c;
             }
         }
-        token = strtok(NULL, ",");
+        for (int c = 0; c < PRIORITY_CLASSES; c++)
+        {
+            credits[c] = lane_weights[c];
+        }
     }
+    return -1;
 }
 
-// Function to wait for data on subscribed topics and send it to the subscriber
-void wait_for_data_and_send(Subscriber *subscriber)
+// Function to get the priority class of an article: its own "priority" field, or else its topic's class
+int article_priority(cJSON *article, int topic_index)
 {
-    // Wait for and send the data for current subscriptions
-    for (int i = 0; i < subscriber->topic_count; i++)
+    cJSON *priority = cJSON_GetObjectItem(article, "priority");
+    if (cJSON_IsString(priority) && parse_priority(priority->valuestring) >= 0)
     {
-        Topic *topic = NULL;
-        for (int j = 0; j < topic_count; j++)
-        {
-            if (strcmp(topics[j].name, subscriber->topics[i]) == 0)
-            {
-                topic = &topics[j];
-                break;
-            }
-        }
+        return parse_priority(priority->valuestring);
+    }
+    return topics[topic_index].priority;
+}
 
-        if (topic != NULL)
-        {
-            pthread_mutex_lock(&topic->mutex);
+// Function to record how long a stored article took from reaching the broker to being sent to a subscriber
+// History older than the subscription isn't live delivery and is skipped
+void record_latency(Subscriber *subscriber, Topic *topic, int index, long long sent_us)
+{
+    if (topic->received_us[index] < subscriber->subscribed_us)
+    {
+        return;
+    }
 
-            while (topic->data_count == 0)
-            {
-                // Wait for new data to arrive for this topic
-                pthread_cond_wait(&topic->cond, &topic->mutex);
-            }
+    long long latency = sent_us - topic->received_us[index];
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && latency >= (1LL << bucket))
+    {
+        bucket++;
+    }
 
-            // Send all data related to this topic to the subscriber
-            for (int j = 0; j < topic->data_count; j++)
-            {
-                if (send(subscriber->sockfd, cJSON_Print(topic->data[j]), strlen(cJSON_Print(topic->data[j])), 0) < 0)
-                {
-                    perror("Failed to send data to subscriber");
-                }
-                printf("Sent data #%d for topic: %s\n", j + 1, topic->name);
-            }
+    LatencyStats *stats = &latency_stats[topic->priority_of[index]];
+    pthread_mutex_lock(&latency_mutex);
+    stats->delivered++;
+    stats->total_us += latency;
+    if (latency > stats->max_us)
+    {
+        stats->max_us = latency;
+    }
+    stats->buckets[bucket]++;
+    pthread_mutex_unlock(&latency_mutex);
+}
 
-            pthread_mutex_unlock(&topic->mutex);
+// Function to get a latency percentile from the histogram (the upper bound of the bucket it falls in)
+long long latency_percentile(const LatencyStats *stats, double percentile)
+{
+    unsigned long threshold = (unsigned long)(stats->delivered * percentile);
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += stats->buckets[i];
+        if (seen > threshold)
+        {
+            return i == LATENCY_BUCKETS - 1 || (1LL << i) > stats->max_us ? stats->max_us : 1LL << i;
         }
     }
+    return stats->max_us;
 }
 
-// Function to handle incoming connections from subscribers
-void *handle_subscriber(void *arg)
+// Function to send the per-class delivery latency stats as one JSON line, answering a "STATS" request
+void send_latency_stats(int sockfd)
 {
-    Subscriber *subscriber = (Subscriber *)arg;
-    char buffer[MAX_BUFFER_SIZE];
-    int bytes_received;
-
-    // Receive and handle subscription information (topics the subscriber is interested in)
-    while ((bytes_received = recv(subscriber->sockfd, buffer, sizeof(buffer) - 1, 0)) > 0)
+    cJSON *root = cJSON_CreateObject();
+    pthread_mutex_lock(&latency_mutex);
+    for (int c = 0; c < PRIORITY_CLASSES; c++)
     {
-        buffer[bytes_received] = '\0'; // Null-terminate the received string
-        printf("Subscriber requested to subscribe to topics: %s\n", buffer);
+        LatencyStats *stats = &latency_stats[c];
+        cJSON *lane = cJSON_AddObjectToObject(root, priority_name(c));
+        cJSON_AddNumberToObject(lane, "delivered", stats->delivered);
+        cJSON_AddNumberToObject(lane, "avg_us", stats->delivered > 0 ? stats->total_us / (long long)stats->delivered : 0);
+        cJSON_AddNumberToObject(lane, "p50_us", latency_percentile(stats, 0.50));
+        cJSON_AddNumberToObject(lane, "p99_us", latency_percentile(stats, 0.99));
+        cJSON_AddNumberToObject(lane, "max_us", stats->max_us);
+    }
+    pthread_mutex_unlock(&latency_mutex);
 
-        // Request subscription based on the received buffer
-        request_subscription(subscriber, buffer);
+    char *json_str = cJSON_PrintUnformatted(root);
+    size_t len = strlen(json_str);
+    json_str[len] = '\n'; // Overwrite the terminator, the line is sent by length
+    send(sockfd, json_str, len + 1, MSG_NOSIGNAL);
+    free(json_str);
+    cJSON_Delete(root);
+}
 
-        break; // Once subscription is handled, we break the loop
+// Function to recompute which topics this broker owns from the partition map
+// A fenced broker gives its topics up to the follower that took them over
+// Must be called with the partition mutex held
+void update_topic_ownership()
+{
+    for (int i = 0; i < topic_count; i++)
+    {
+        int owner_id = find_topic_owner(&partition_map, topics[i].name)->id;
+        __atomic_store_n(&topic_owned[i], (owner_id == broker_id && !fenced) || promoted[owner_id], __ATOMIC_RELEASE);
+        topics[i].priority = find_topic_priority(&partition_map, topics[i].name);
     }
+}
 
-    // After subscription, wait for and send the data for subscribed topics
-    wait_for_data_and_send(subscriber);
+// Function to check whether this broker owns a topic, without taking the partition mutex
+int owns_topic(int topic_index)
+{
+    return __atomic_load_n(&topic_owned[topic_index], __ATOMIC_ACQUIRE);
+}
 
-    // Subscriber disconnected
-    printf("Subscriber disconnected\n");
-    close(subscriber->sockfd);
-    free(subscriber);
-    return NULL;
+// Function to get the address of the broker currently owning a topic
+void get_topic_owner(int topic_index, BrokerAddress *owner)
+{
+    pthread_mutex_lock(&partition_mutex);
+    *owner = *find_topic_owner(&partition_map, topics[topic_index].name);
+    for (int i = 0; i < follower_count && owner->id == broker_id && fenced; i++)
+    {
+        if (followers[i].refused)
+        {
+            *owner = followers[i].address;
+        }
+    }
+    pthread_mutex_unlock(&partition_mutex);
 }
 
-// Main function for broker server
-int main()
+// Function to serialize an article for forwarding to another broker
+// The line is marked with "forwarded_by" so the receiving broker stores it instead of forwarding it again
+// Returns the newline-terminated line (to be freed by the caller) and sets its length, or NULL on failure
+char *forwarded_line(cJSON *article, size_t *len)
 {
-    int server_fd_subscriber, server_fd_publisher, new_sock_subscriber, new_sock_publisher;
-    struct sockaddr_in address_subscriber, address_publisher;
-    int addrlen_subscriber = sizeof(address_subscriber), addrlen_publisher = sizeof(address_publisher);
+    cJSON *copy = cJSON_Duplicate(article, 1);
+    cJSON_DeleteItemFromObject(copy, "forwarded_by");
+    cJSON_AddNumberToObject(copy, "forwarded_by", broker_id);
+    char *json_str = cJSON_PrintUnformatted(copy);
+    cJSON_Delete(copy);
+    if (json_str == NULL)
+    {
+        return NULL;
+    }
+    *len = strlen(json_str);
+    json_str[(*len)++] = '\n'; // Overwrite the terminator, the line is sent by length
+    return json_str;
+}
 
-    // Initialize mutexes and condition variables
-    init_topic_mutexes_and_cond();
+void *forward_articles(void *arg);
+int get_follower(int leader_id, BrokerAddress *follower);
 
-    // Predefine 3 topics
-    topics[0].name = "Reuters";
-    topics[1].name = "BBC";
-    topics[2].name = "CNN";
-    topic_count = 3;
+// Function to queue an article line for forwarding to another broker, taking ownership of the line
+// If wait is set, blocks while the broker's queue is full; otherwise the article is dropped then
+// Returns 0 if the article was dropped
+int queue_forward(int target_id, char *line, size_t len, int wait)
+{
+    ForwardQueue *queue = &forward_queues[target_id];
 
-    // Create socket for subscribers
-    if ((server_fd_subscriber = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    pthread_mutex_lock(&forward_mutex);
+    if (!queue->started)
     {
-        perror("Subscriber socket failed");
-        exit(1);
+        pthread_t forward_thread;
+        pthread_create(&forward_thread, NULL, forward_articles, (void *)(long)target_id);
+        pthread_detach(forward_thread);
+        queue->started = 1;
     }
-    address_subscriber.sin_family = AF_INET;
-    address_subscriber.sin_addr.s_addr = INADDR_ANY;
-    address_subscriber.sin_port = htons(PORT_SUBSCRIBER);
-
-    if (bind(server_fd_subscriber, (struct sockaddr *)&address_subscriber, sizeof(address_subscriber)) < 0)
+    while (queue->count == MAX_FORWARD_QUEUE && wait)
     {
-        perror("Bind failed");
-        exit(1);
+        pthread_cond_wait(&queue->cond, &forward_mutex);
     }
-    if (listen(server_fd_subscriber, 3) < 0)
+    if (queue->count == MAX_FORWARD_QUEUE)
     {
-        perror("Listen failed");
-        exit(1);
+        pthread_mutex_unlock(&forward_mutex);
+        fprintf(stderr, "Too many articles waiting to be forwarded to broker %d, dropping one\n", target_id);
+        free(line);
+        return 0;
     }
+    int tail = (queue->head + queue->count) % MAX_FORWARD_QUEUE;
+    queue->lines[tail] = line;
+    queue->lengths[tail] = len;
+    queue->count++;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&forward_mutex);
+    return 1;
+}
 
-    // Create socket for publishers
-    if ((server_fd_publisher = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+// Function to send a line to another broker over the forwarding connection
+// Only called by that broker's forwarding thread; returns 0 if the broker couldn't be reached
+int send_to_broker(int target_id, const char *line, size_t len)
+{
+    ForwardQueue *queue = &forward_queues[target_id];
+    BrokerAddress target;
+    pthread_mutex_lock(&partition_mutex);
+    const BrokerAddress *address = find_broker(&partition_map, target_id);
+    if (address != NULL)
     {
-        perror("Publisher socket failed");
-        exit(1);
+        target = *address;
     }
-    address_publisher.sin_family = AF_INET;
-    address_publisher.sin_addr.s_addr = INADDR_ANY;
-    address_publisher.sin_port = htons(PORT_PUBLISHER);
-
-    if (bind(server_fd_publisher, (struct sockaddr *)&address_publisher, sizeof(address_publisher)) < 0)
+    pthread_mutex_unlock(&partition_mutex);
+    if (address == NULL)
     {
-        perror("Bind failed");
-        exit(1);
+        return 0;
     }
-    if (listen(server_fd_publisher, 3) < 0)
+
+    // Retry once on a fresh connection in case the broker restarted
+    for (int attempt = 0; attempt < 2; attempt++)
     {
-        perror("Listen failed");
-        exit(1);
+        if (queue->sockfd < 0)
+        {
+            queue->sockfd = connect_to_broker(target.host, target.publisher_port);
+            if (queue->sockfd < 0)
+            {
+                return 0;
+            }
+
+            // A peer that stops reading must not hold its queue up forever
+            struct timeval timeout = {FORWARD_SEND_TIMEOUT_S, 0};
+            setsockopt(queue->sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            // Identify as a broker, so the owner doesn't treat our disconnect as the publisher finishing
+            char hello[32];
+            int hello_len = snprintf(hello, sizeof(hello), "BROKER %d\n", broker_id);
+            send(queue->sockfd, hello, hello_len, MSG_NOSIGNAL);
+        }
+
+        if (send(queue->sockfd, line, len, MSG_NOSIGNAL) == (ssize_t)len)
+        {
+            return 1;
+        }
+        close(queue->sockfd);
+        queue->sockfd = -1;
     }
+    return 0;
+}
+
+// Function to send the articles queued for another broker, in order, run in a thread per broker
+// Articles the broker can't take (or queued before this broker took its topics over) go to its follower
+void *forward_articles(void *arg)
+{
+    int target_id = (int)(long)arg;
+    ForwardQueue *queue = &forward_queues[target_id];
 
-    // Create epoll instance
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1)
+    while (1)
     {
-        perror("Epoll create failed");
-        exit(1);
+        pthread_mutex_lock(&forward_mutex);
+        while (queue->count == 0)
+        {
+            pthread_cond_wait(&queue->cond, &forward_mutex);
+        }
+        char *line = queue->lines[queue->head];
+        size_t len = queue->lengths[queue->head];
+        queue->head = (queue->head + 1) % MAX_FORWARD_QUEUE;
+        queue->count--;
+        pthread_cond_broadcast(&queue->cond); // Room for a blocked sender
+        pthread_mutex_unlock(&forward_mutex);
+
+        // A leader being checked may be dead with its socket still accepting, hold its articles until that is settled
+        pthread_mutex_lock(&partition_mutex);
+        while (watched_leaders[target_id])
+        {
+            pthread_mutex_unlock(&partition_mutex);
+            usleep(WAIT_TIMEOUT_MS * 1000);
+            pthread_mutex_lock(&partition_mutex);
+        }
+        int taken_over = promoted[target_id];
+        pthread_mutex_unlock(&partition_mutex);
+
+        if (!taken_over && send_to_broker(target_id, line, len))
+        {
+            free(line);
+            continue;
+        }
+        if (!taken_over)
+        {
+            fprintf(stderr, "Failed to forward data to broker %d\n", target_id);
+        }
+
+        // (Without waiting: the follower's own thread may be waiting for room in this queue)
+        BrokerAddress follower;
+        if (get_follower(target_id, &follower) && follower.id != target_id)
+        {
+            queue_forward(follower.id, line, len, 0);
+        }
+        else
+        {
+            free(line);
+        }
     }
+    return NULL;
+}
 
-    // Add subscriber and publisher sockets to epoll instance
-    struct epoll_event event;
-    event.events = EPOLLIN;
-    event.data.fd = server_fd_subscriber;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd_subscriber, &event) == -1)
+// Function to get the address of a broker's follower, returns 0 if it has none
+int get_follower(int leader_id, BrokerAddress *follower)
+{
+    pthread_mutex_lock(&partition_mutex);
+    const BrokerAddress *address = find_follower(&partition_map, leader_id);
+    if (address != NULL)
     {
-        perror("Epoll ctl failed (subscriber)");
-        exit(1);
+        *follower = *address;
     }
+    pthread_mutex_unlock(&partition_mutex);
+    return address != NULL;
+}
 
-    event.data.fd = server_fd_publisher;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd_publisher, &event) == -1)
+// Function to drop a topic's stored articles once this broker gave it up, so they aren't kept or served twice if the
+// topic comes back. Offsets acked in durable subscriptions and consumer groups start over with them
+// The articles are retired rather than freed, as threads serving them read them without the lock; they are freed
+// when the topic is given up the next time. Must be called with the topic mutex held
+void clear_topic(int topic_index)
+{
+    Topic *topic = &topics[topic_index];
+    for (int j = 0; j < topic->retired_count; j++)
     {
-        perror("Epoll ctl failed (publisher)");
-        exit(1);
+        cJSON_Delete(topic->retired[j]);
+        free(topic->retired_frames[j]);
     }
+    memcpy(topic->retired, topic->data, topic->data_count * sizeof(cJSON *));
+    memcpy(topic->retired_frames, topic->frames, topic->data_count * sizeof(unsigned char *));
+    topic->retired_count = topic->data_count;
+    topic->data_count = 0;
+    topic->committed_count = 0;
+    topic->offsets[0] = 0;
+    topic->generation++;
+    if (topic->segment_fd >= 0 && ftruncate(topic->segment_fd, 0) != 0)
+    {
+        perror("Failed to truncate topic segment");
+        close(topic->segment_fd);
+        topic->segment_fd = -1;
+    }
+    search_index_reset(&topic->search);
 
-    struct epoll_event events[MAX_EVENTS];
-    printf("Broker is running...\n");
-
-    // Start processing events
-    while (1)
+    pthread_mutex_lock(&durable_mutex);
+    for (int i = 0; i < durable_count; i++)
     {
-        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-        if (n == -1)
-        {
-            perror("Epoll wait failed");
-            exit(1);
-        }
+        durable_subscriptions[i].acked_seq[topic_index] = 0;
+    }
+    pthread_mutex_unlock(&durable_mutex);
 
-        // Loop through all the events
-        for (int i = 0; i < n; i++)
+    pthread_mutex_lock(&consumer_groups_mutex);
+    for (int i = 0; i < consumer_group_count; i++)
+    {
+        ConsumerGroup *group = &consumer_groups[i];
+        pthread_mutex_lock(&group->mutex);
+        for (int j = 0; j < MAX_DATA; j++)
         {
-            if (events[i].data.fd == server_fd_publisher)
+            if (group->owner[topic_index][j] != NULL && group->state[topic_index][j] != DELIVERY_ACKED)
             {
-                // Handle publisher connection
-                new_sock_publisher = accept(server_fd_publisher, (struct sockaddr *)&address_publisher, (socklen_t *)&addrlen_publisher);
-                if (new_sock_publisher < 0)
+                group->owner[topic_index][j]->outstanding--;
+            }
+            group->owner[topic_index][j] = NULL;
+            group->state[topic_index][j] = DELIVERY_UNASSIGNED;
+        }
+        group->acked_below[topic_index] = 0;
+        pthread_mutex_unlock(&group->mutex);
+    }
+    pthread_mutex_unlock(&consumer_groups_mutex);
+}
+
+// Function to hand a topic's stored articles over to its new owner after a partition move, and drop them here
+// Must be called with the topic mutex held, so articles published meanwhile are queued behind the migrated ones
+void migrate_topic(int topic_index)
+{
+    Topic *topic = &topics[topic_index];
+    BrokerAddress owner;
+    get_topic_owner(topic_index, &owner);
+
+    int migrated = 0;
+    for (int j = 0; j < topic->data_count; j++)
+    {
+        size_t len;
+        char *line = forwarded_line(topic->data[j], &len);
+        if (line != NULL && queue_forward(owner.id, line, len, 1))
+        {
+            migrated++;
+        }
+    }
+    printf("Moved topic '%s' to broker %d (%d of %d articles migrated)\n", topic->name, owner.id, migrated, topic->data_count);
+    clear_topic(topic_index);
+}
+
+// Function to reload the partition map and migrate the topics this broker no longer owns
+void reload_partition_map()
+{
+    PartitionMap new_map;
+    if (!load_partition_map(partition_map_file, &new_map) || find_broker(&new_map, broker_id) == NULL)
+    {
+        fprintf(stderr, "Invalid partition map, keeping the current one\n");
+        return;
+    }
+
+    // Ownership changes with every topic mutex held, so no article is stored or forwarded under the old ownership
+    // once the migration is queued
+    for (int i = 0; i < topic_count; i++)
+    {
+        pthread_mutex_lock(&topics[i].mutex);
+    }
+
+    int was_owned[MAX_TOPICS];
+    pthread_mutex_lock(&partition_mutex);
+    memcpy(was_owned, topic_owned, sizeof(was_owned));
+    partition_map = new_map;
+    ack_mode = new_map.ack_mode;
+    update_topic_ownership();
+    pthread_mutex_unlock(&partition_mutex);
+
+    for (int i = 0; i < topic_count; i++)
+    {
+        if (was_owned[i] && !owns_topic(i))
+        {
+            migrate_topic(i);
+        }
+        else if (!was_owned[i] && owns_topic(i))
+        {
+            printf("Now owning topic '%s'\n", topics[i].name);
+        }
+        pthread_mutex_unlock(&topics[i].mutex);
+    }
+
+    notify_new_data(); // Let subscriber threads redirect away from moved topics
+}
+
+// Function to mark a follower's replication stream as up or down
+void set_follower_connected(Follower *follower, int connected)
+{
+    pthread_mutex_lock(&replication_mutex);
+    if (!connected && __atomic_load_n(&follower->connected, __ATOMIC_ACQUIRE))
+    {
+        follower->down_since_us = now_us();
+    }
+    __atomic_store_n(&follower->connected, connected, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&replication_mutex);
+}
+
+// Function to check whether a follower's stream is down for longer than commits wait for it
+// Must be called with the replication mutex held
+int follower_timed_out(Follower *follower, long long now)
+{
+    return !__atomic_load_n(&follower->connected, __ATOMIC_ACQUIRE) && now - follower->down_since_us >= REPLICATION_ACK_TIMEOUT_MS * 1000LL;
+}
+
+// Function to recompute how many articles of a topic may be delivered, according to the ack mode
+// Followers that timed out are left out, when none is left the leader commits on its own
+// Must be called with the topic mutex held
+void update_committed_count(int topic_index)
+{
+    Topic *topic = &topics[topic_index];
+    int committed = topic->data_count;
+
+    if (follower_count > 0 && ack_mode != ACK_MODE_ASYNC)
+    {
+        long long now = now_us();
+        int waiting = 0; // No of followers the commit waits for
+        committed = ack_mode == ACK_MODE_ONE ? 0 : topic->data_count;
+        pthread_mutex_lock(&replication_mutex);
+        for (int i = 0; i < follower_count; i++)
+        {
+            if (follower_timed_out(&followers[i], now))
+            {
+                continue;
+            }
+            waiting++;
+            int acked = followers[i].acked_count[topic_index];
+            if ((ack_mode == ACK_MODE_ONE && acked > committed) || (ack_mode == ACK_MODE_ALL && acked < committed))
+            {
+                committed = acked;
+            }
+        }
+        pthread_mutex_unlock(&replication_mutex);
+        if (waiting == 0)
+        {
+            committed = topic->data_count;
+        }
+    }
+
+    // Committed articles may already have been delivered, a follower coming back doesn't take them back
+    if (committed > topic->data_count)
+    {
+        committed = topic->data_count;
+    }
+    if (committed > topic->committed_count)
+    {
+        topic->committed_count = committed;
+    }
+}
+
+// Function to recompute how many articles of every topic may be delivered, once a follower timed out
+void update_committed_counts()
+{
+    for (int i = 0; i < topic_count; i++)
+    {
+        pthread_mutex_lock(&topics[i].mutex);
+        update_committed_count(i);
+        pthread_mutex_unlock(&topics[i].mutex);
+    }
+    notify_new_data();
+}
+
+// Function to record whether a follower refused the replication stream because it took this broker's topics over
+// While one does, this broker is fenced: it gives its topics up and redirects their clients to that follower
+void set_follower_refused(Follower *follower, int refused)
+{
+    pthread_mutex_lock(&partition_mutex);
+    int was_fenced = fenced;
+    follower->refused = refused;
+    fenced = 0;
+    for (int i = 0; i < follower_count; i++)
+    {
+        fenced |= followers[i].refused;
+    }
+    update_topic_ownership();
+    int now_fenced = fenced;
+    pthread_mutex_unlock(&partition_mutex);
+
+    if (now_fenced != was_fenced)
+    {
+        if (now_fenced)
+        {
+            printf("Follower %d took over this broker's topics, giving them up\n", follower->address.id);
+        }
+        else
+        {
+            printf("Follower %d accepts replication again, owning this broker's topics\n", follower->address.id);
+        }
+        notify_new_data(); // Let subscriber threads redirect
+    }
+}
+
+// Function to process an "ACK <topic> <count>" line from a follower: it stored the first <count> articles
+void process_follower_ack(Follower *follower, const char *line)
+{
+    char topic_name[MAX_NAME_LENGTH];
+    int count;
+    if (sscanf(line, "ACK %63s %d", topic_name, &count) != 2)
+    {
+        return;
+    }
+    int topic_index = find_topic_index(topic_name);
+    if (topic_index < 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&topics[topic_index].mutex);
+    pthread_mutex_lock(&replication_mutex);
+    if (count > follower->acked_count[topic_index])
+    {
+        follower->acked_count[topic_index] = count;
+    }
+    pthread_mutex_unlock(&replication_mutex);
+    update_committed_count(topic_index);
+    pthread_mutex_unlock(&topics[topic_index].mutex);
+}
+
+// Function to read the acks of a follower until its stream closes, run in its own thread
+void *read_follower_acks(void *arg)
+{
+    Follower *follower = (Follower *)arg;
+    char buffer[MAX_BUFFER_SIZE];
+    int buffer_len = 0;
+    int bytes_received;
+
+    while ((bytes_received = recv(follower->sockfd, buffer + buffer_len, sizeof(buffer) - buffer_len - 1, 0)) > 0)
+    {
+        buffer_len += bytes_received;
+        buffer[buffer_len] = '\0';
+
+        char *line = buffer;
+        char *newline;
+        while ((newline = strchr(line, '\n')) != NULL)
+        {
+            *newline = '\0';
+            process_follower_ack(follower, line);
+            line = newline + 1;
+        }
+        buffer_len -= line - buffer;
+        memmove(buffer, line, buffer_len);
+        if (buffer_len == sizeof(buffer) - 1)
+        {
+            buffer_len = 0;
+        }
+
+        notify_new_data(); // Newly committed articles can be delivered
+    }
+
+    set_follower_connected(follower, 0);
+    notify_new_data(); // Let the replication thread notice
+    return NULL;
+}
+
+// Function to open the replication stream to a follower
+// The follower answers with how many articles of each topic it already has, so only the gap is sent,
+// or with "FENCED" if it took this broker's topics over
+// Returns 0 if the follower couldn't be reached or refused the stream
+int connect_to_follower(Follower *follower)
+{
+    follower->sockfd = connect_to_broker(follower->address.host, follower->address.publisher_port);
+    if (follower->sockfd < 0)
+    {
+        return 0;
+    }
+
+    char hello[32];
+    int hello_len = snprintf(hello, sizeof(hello), "REPLICATE %d\n", broker_id);
+    send(follower->sockfd, hello, hello_len, MSG_NOSIGNAL);
+
+    // Read "ACK <topic> <count>" lines until "READY"
+    char buffer[MAX_BUFFER_SIZE];
+    int buffer_len = 0;
+    while (buffer_len < (int)sizeof(buffer) - 1)
+    {
+        int bytes_received = recv(follower->sockfd, buffer + buffer_len, sizeof(buffer) - buffer_len - 1, 0);
+        if (bytes_received <= 0)
+        {
+            break;
+        }
+        buffer_len += bytes_received;
+        buffer[buffer_len] = '\0';
+        if (strcmp(buffer, "FENCED\n") == 0)
+        {
+            set_follower_refused(follower, 1);
+            break;
+        }
+        if (strstr(buffer, "READY\n") == NULL)
+        {
+            continue;
+        }
+
+        for (char *line = strtok(buffer, "\n"); line != NULL; line = strtok(NULL, "\n"))
+        {
+            process_follower_ack(follower, line);
+        }
+        for (int i = 0; i < topic_count; i++)
+        {
+            follower->sent_count[i] = follower->acked_count[i];
+        }
+        set_follower_refused(follower, 0);
+        set_follower_connected(follower, 1);
+        printf("Replicating to follower %d\n", follower->address.id);
+        return 1;
+    }
+
+    close(follower->sockfd);
+    follower->sockfd = -1;
+    return 0;
+}
+
+// Function to stream the owned topics to a follower, reconnecting whenever the stream breaks
+// Articles are sent in batches without waiting for acks (pipelined), acks are read by another thread
+void *replicate_to_follower(void *arg)
+{
+    Follower *follower = (Follower *)arg;
+    int committing_alone = 0; // Whether commits stopped waiting for the follower
+
+    while (1)
+    {
+        if (!connect_to_follower(follower))
+        {
+            // Stop holding articles back from subscribers once the follower stays away too long
+            pthread_mutex_lock(&replication_mutex);
+            int timed_out = follower_timed_out(follower, now_us());
+            pthread_mutex_unlock(&replication_mutex);
+            if (timed_out && !committing_alone && ack_mode != ACK_MODE_ASYNC)
+            {
+                printf("Follower %d unreachable for %d ms, committing without it\n", follower->address.id, REPLICATION_ACK_TIMEOUT_MS);
+                committing_alone = 1;
+                update_committed_counts();
+            }
+            sleep(follower->refused ? FENCED_RETRY_S : 1);
+            continue;
+        }
+        committing_alone = 0;
+
+        pthread_t ack_thread;
+        pthread_create(&ack_thread, NULL, read_follower_acks, (void *)follower);
+
+        while (__atomic_load_n(&follower->connected, __ATOMIC_ACQUIRE))
+        {
+            unsigned long generation = get_data_generation();
+
+            // Batch every article not yet sent into a single send
+            char *batch = NULL;
+            size_t batch_len = 0;
+            for (int t = 0; t < topic_count; t++)
+            {
+                if (!owns_topic(t))
+                {
+                    continue;
+                }
+                pthread_mutex_lock(&topics[t].mutex);
+
+                // The topic was given up (and got back) since the counts were taken: the follower drops its copy too
+                int truncated = follower->sent_generation[t] != topics[t].generation;
+                if (truncated)
+                {
+                    char truncate[MAX_NAME_LENGTH + 16];
+                    int len = snprintf(truncate, sizeof(truncate), "TRUNCATE %s\n", topics[t].name);
+                    batch = realloc(batch, batch_len + len);
+                    memcpy(batch + batch_len, truncate, len);
+                    batch_len += len;
+                    follower->sent_generation[t] = topics[t].generation;
+                    follower->sent_count[t] = 0;
+                    pthread_mutex_lock(&replication_mutex);
+                    follower->acked_count[t] = 0;
+                    pthread_mutex_unlock(&replication_mutex);
+                }
+
+                // A reconnecting follower catches up straight from the segment file
+                if (!truncated && topics[t].segment_fd >= 0 && topics[t].data_count - follower->sent_count[t] >= REPLAY_MIN_ARTICLES)
+                {
+                    int segment_fd = topics[t].segment_fd;
+                    off_t start = topics[t].offsets[follower->sent_count[t]];
+                    off_t end = topics[t].offsets[topics[t].data_count];
+                    follower->sent_count[t] = topics[t].data_count;
+                    pthread_mutex_unlock(&topics[t].mutex);
+                    if (!send_from_segment(follower->sockfd, segment_fd, start, end))
+                    {
+                        set_follower_connected(follower, 0);
+                    }
+                    continue;
+                }
+
+                for (; follower->sent_count[t] < topics[t].data_count; follower->sent_count[t]++)
+                {
+                    char *json_str = cJSON_PrintUnformatted(topics[t].data[follower->sent_count[t]]);
+                    size_t len = strlen(json_str);
+                    batch = realloc(batch, batch_len + len + 1);
+                    memcpy(batch + batch_len, json_str, len);
+                    batch[batch_len + len] = '\n';
+                    batch_len += len + 1;
+                    free(json_str);
+                }
+                pthread_mutex_unlock(&topics[t].mutex);
+            }
+
+            if (batch_len > 0)
+            {
+                int ok = send(follower->sockfd, batch, batch_len, MSG_NOSIGNAL) == (ssize_t)batch_len;
+                free(batch);
+                if (!ok)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                wait_for_new_data(generation, WAIT_TIMEOUT_MS * 1000);
+            }
+        }
+
+        printf("Replication stream to follower %d broke, reconnecting\n", follower->address.id);
+        set_follower_connected(follower, 0);
+        shutdown(follower->sockfd, SHUT_RDWR);
+        pthread_join(ack_thread, NULL);
+        close(follower->sockfd);
+        follower->sockfd = -1;
+    }
+    return NULL;
+}
+
+// Function to store an article replicated from the leader, keeping the leader's sequence number
+// Returns the index of its topic, or -1 if it couldn't be applied
+int apply_replicated_article(const char *json_data)
+{
+    cJSON *root = cJSON_Parse(json_data);
+    cJSON *source = root != NULL ? cJSON_GetObjectItem(root, "source") : NULL;
+    cJSON *name = source != NULL ? cJSON_GetObjectItem(source, "name") : NULL;
+    cJSON *seq = root != NULL ? cJSON_GetObjectItem(root, "seq") : NULL;
+    int topic_index = name != NULL ? find_topic_index(name->valuestring) : -1;
+    if (topic_index < 0 || seq == NULL)
+    {
+        fprintf(stderr, "Invalid replicated article\n");
+        cJSON_Delete(root);
+        return -1;
+    }
+
+    Topic *topic = &topics[topic_index];
+    cJSON *stored = NULL;
+    pthread_mutex_lock(&topic->mutex);
+    if (seq->valueint == topic->data_count + 1 && topic->data_count < MAX_DATA)
+    {
+        topic->priority_of[topic->data_count] = article_priority(root, topic_index);
+        topic->received_us[topic->data_count] = now_us();
+        topic->data[topic->data_count++] = root;
+        append_to_segment(topic);
+        encode_stored_article(topic);
+        update_committed_count(topic_index);
+        stored = root;
+        root = NULL;
+    }
+    else if (seq->valueint > topic->data_count + 1)
+    {
+        fprintf(stderr, "Gap in replicated topic '%s': expected seq %d, got %d\n", topic->name, topic->data_count + 1, seq->valueint);
+    }
+    pthread_mutex_unlock(&topic->mutex);
+
+    if (stored != NULL)
+    {
+        search_index_add(&topic->search, seq->valueint - 1, stored);
+    }
+    cJSON_Delete(root); // Already stored (a resent duplicate), or rejected
+    return topic_index;
+}
+
+// Function to take over the topics of a leader whose replication stream went away
+// From then on the leader's replication stream is refused, which fences the leader off its topics
+void promote_over_leader(int leader_id)
+{
+    pthread_mutex_lock(&partition_mutex);
+    promoted[leader_id] = 1;
+    update_topic_ownership();
+    pthread_mutex_unlock(&partition_mutex);
+
+    printf("Leader %d is gone, taking over its topics\n", leader_id);
+    notify_new_data();
+}
+
+// Function to check whether a broker is up, by asking it for its latency stats
+// (the listening socket of a broker that was just killed may still accept connections, but nothing answers)
+int broker_alive(const BrokerAddress *address)
+{
+    int sockfd = connect_to_broker(address->host, address->subscriber_port);
+    if (sockfd < 0)
+    {
+        return 0;
+    }
+    struct timeval timeout = {LEADER_PROBE_TIMEOUT_S, 0};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char reply[64];
+    int alive = send(sockfd, "STATS\n", 6, MSG_NOSIGNAL) == 6 && recv(sockfd, reply, sizeof(reply), 0) > 0;
+    close(sockfd);
+    return alive;
+}
+
+// Function to wait after a leader's replication stream broke: a leader that is still up reconnects the stream,
+// one that can't be reached any more is taken over (so the two never own the topics at the same time)
+void watch_leader(int leader_id)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&partition_mutex);
+        int back = replication_streams[leader_id] > 0 || promoted[leader_id];
+        watched_leaders[leader_id] = !back;
+        const BrokerAddress *address = find_broker(&partition_map, leader_id);
+        BrokerAddress leader;
+        if (address != NULL)
+        {
+            leader = *address;
+        }
+        pthread_mutex_unlock(&partition_mutex);
+
+        if (back)
+        {
+            return;
+        }
+        if (address == NULL || !broker_alive(&leader))
+        {
+            promote_over_leader(leader_id);
+            pthread_mutex_lock(&partition_mutex);
+            watched_leaders[leader_id] = 0;
+            pthread_mutex_unlock(&partition_mutex);
+            return;
+        }
+        sleep(1);
+    }
+}
+
+// Signal handler for SIGHUP, the reload itself happens in the main loop
+void request_reload(int signum)
+{
+    (void)signum;
+    reload_requested = 1;
+}
+
+// Function to find a durable subscription by name, creating it if needed, and attach it to a connection
+// The topics are claimed one by one as they are subscribed, so a client may consume them over several connections
+// (e.g. a topic it followed here after the topic moved); returns NULL if the limit is reached
+DurableSubscription *attach_durable_subscription(const char *name)
+{
+    DurableSubscription *durable = NULL;
+
+    pthread_mutex_lock(&durable_mutex);
+    for (int i = 0; i < durable_count; i++)
+    {
+        if (strcmp(durable_subscriptions[i].name, name) == 0)
+        {
+            durable = &durable_subscriptions[i];
+            break;
+        }
+    }
+
+    if (durable == NULL && durable_count < MAX_DURABLE_SUBSCRIPTIONS)
+    {
+        durable = &durable_subscriptions[durable_count++];
+        memset(durable, 0, sizeof(*durable));
+        strncpy(durable->name, name, MAX_NAME_LENGTH - 1);
+    }
+
+    pthread_mutex_unlock(&durable_mutex);
+
+    return durable;
+}
+
+// Function to claim a topic of a durable subscription for a connection
+// Only one connection may consume a topic of a durable subscription at a time; returns 0 if another one does
+int claim_durable_topic(DurableSubscription *durable, int topic_index)
+{
+    pthread_mutex_lock(&durable_mutex);
+    int claimed = !durable->active[topic_index];
+    durable->active[topic_index] = 1;
+    pthread_mutex_unlock(&durable_mutex);
+    return claimed;
+}
+
+// Function to release a topic of a durable subscription, once its connection stops consuming it
+void release_durable_topic(DurableSubscription *durable, int topic_index)
+{
+    if (durable == NULL || topic_index < 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&durable_mutex);
+    durable->active[topic_index] = 0;
+    pthread_mutex_unlock(&durable_mutex);
+}
+
+// Function to detach a durable subscription when its connection goes away, releasing the topics it consumed
+void detach_durable_subscription(Subscriber *subscriber)
+{
+    for (int i = 0; i < subscriber->topic_count; i++)
+    {
+        release_durable_topic(subscriber->durable, find_topic_index(subscriber->topics[i]));
+    }
+}
+
+// Function to start batching writes to a subscriber with the broker's coalescing settings
+void start_coalescing(Subscriber *subscriber)
+{
+    pthread_mutex_lock(&partition_mutex);
+    subscriber->budget_us = partition_map.coalesce_budget_us;
+    subscriber->cork = partition_map.coalesce_cork && subscriber->ring == NULL;
+    pthread_mutex_unlock(&partition_mutex);
+    subscriber->last_flush_us = now_us();
+    if (subscriber->ring != NULL)
+    {
+        return; // Not a TCP socket
+    }
+
+    // Batching is up to the broker, so Nagle mustn't hold back what it decided to write
+    int nodelay = 1;
+    setsockopt(subscriber->sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
+// Function to set or clear TCP_CORK on a subscriber socket, if the broker corks batches
+void set_cork(Subscriber *subscriber, int corked)
+{
+    if (subscriber->cork && subscriber->corked != corked)
+    {
+        setsockopt(subscriber->sockfd, IPPROTO_TCP, TCP_CORK, &corked, sizeof(corked));
+        subscriber->corked = corked;
+    }
+}
+
+// Function to free the pending batch of a subscriber without writing it
+void drop_pending_articles(Subscriber *subscriber)
+{
+    for (int i = 0; i < subscriber->pending_count; i++)
+    {
+        free(subscriber->pending[i]);
+    }
+    subscriber->pending_count = 0;
+    subscriber->pending_bytes = 0;
+    subscriber->pending_urgent = 0;
+}
+
+// Function to write the pending batch to the subscriber in one submission
+// Returns 0 if the subscriber can no longer be reached
+int flush_articles(Subscriber *subscriber)
+{
+    if (subscriber->pending_count == 0)
+    {
+        return 1;
+    }
+
+    set_cork(subscriber, 1);
+    int ok;
+    if (subscriber->ring != NULL)
+    {
+        ok = shm_ring_write(subscriber->ring, subscriber->pending_iov, subscriber->pending_count);
+    }
+    else
+    {
+        ok = io_send_batch(subscriber->sender, subscriber->sockfd, subscriber->pending_iov, subscriber->pending_count);
+    }
+    if (!ok)
+    {
+        perror("Failed to send data to subscriber");
+        drop_pending_articles(subscriber);
+        return 0;
+    }
+
+    long long sent_us = now_us();
+    for (int i = 0; i < subscriber->pending_count; i++)
+    {
+        record_latency(subscriber, subscriber->pending_topic[i], subscriber->pending_index[i], sent_us);
+    }
+
+    // Track the article rate, which sizes the next batches
+    long long elapsed_us = sent_us - subscriber->last_flush_us;
+    double rate = subscriber->pending_count * 1000000.0 / (elapsed_us > 0 ? elapsed_us : 1);
+    subscriber->article_rate = subscriber->article_rate == 0 ? rate : (1 - RATE_SMOOTHING) * subscriber->article_rate + RATE_SMOOTHING * rate;
+    subscriber->last_flush_us = sent_us;
+
+    drop_pending_articles(subscriber);
+    return 1;
+}
+
+// Function to check whether the pending batch should be written now
+// In low-latency mode (no budget) it always should; otherwise once it holds what the observed rate fills within the budget,
+// once its oldest article has waited the whole budget, or as soon as an urgent article is in it
+int flush_due(Subscriber *subscriber)
+{
+    if (subscriber->pending_count == 0)
+    {
+        return 0;
+    }
+    if (subscriber->budget_us == 0 || subscriber->pending_urgent)
+    {
+        return 1;
+    }
+    if (now_us() - subscriber->pending_since_us >= subscriber->budget_us)
+    {
+        return 1;
+    }
+
+    double frame_bytes = (double)subscriber->pending_bytes / subscriber->pending_count;
+    double threshold = subscriber->article_rate * subscriber->budget_us / 1000000.0 * frame_bytes;
+    return subscriber->pending_bytes >= threshold;
+}
+
+// Function to queue a stored article for the subscriber as a single newline-terminated JSON line
+// Binary subscribers get the article's stored frame instead (stored articles never change, so it isn't copied)
+// Returns 0 if the subscriber can no longer be reached (a full batch is written right away)
+int queue_article(Subscriber *subscriber, Topic *topic, int index)
+{
+    char *json_str = NULL;
+    size_t len;
+    int k = subscriber->pending_count;
+    if (subscriber->binary && topic->frames[index] != NULL)
+    {
+        subscriber->pending_iov[k].iov_base = topic->frames[index];
+        len = topic->frame_length[index];
+    }
+    else
+    {
+        json_str = cJSON_PrintUnformatted(topic->data[index]);
+        if (json_str == NULL)
+        {
+            return 1;
+        }
+        len = strlen(json_str);
+        json_str[len++] = '\n'; // Overwrite the terminator, the line is sent by length
+        subscriber->pending_iov[k].iov_base = json_str;
+    }
+
+    subscriber->pending_count++;
+    subscriber->pending[k] = json_str; // Freed once written, NULL for a borrowed frame
+    subscriber->pending_iov[k].iov_len = len;
+    subscriber->pending_topic[k] = topic;
+    subscriber->pending_index[k] = index;
+    if (k == 0)
+    {
+        subscriber->pending_since_us = now_us();
+    }
+    subscriber->pending_bytes += len;
+    subscriber->pending_urgent |= topic->priority_of[index] == PRIORITY_URGENT;
+
+    if (subscriber->pending_count == MAX_COALESCE_FRAMES || subscriber->pending_bytes >= COALESCE_MAX_BYTES)
+    {
+        return flush_articles(subscriber);
+    }
+    return 1;
+}
+
+// Function to send a control line to a subscriber, after the articles queued before it
+void send_line(Subscriber *subscriber, const char *line, int len)
+{
+    if (!flush_articles(subscriber))
+    {
+        return;
+    }
+    if (subscriber->ring != NULL)
+    {
+        struct iovec iov = {(void *)line, len};
+        shm_ring_write(subscriber->ring, &iov, 1);
+    }
+    else
+    {
+        send(subscriber->sockfd, line, len, MSG_NOSIGNAL);
+    }
+}
+
+// Function to tell a subscriber that a topic lives on another broker ("MOVED <topic> <host> <port>")
+void send_moved(Subscriber *subscriber, int topic_index)
+{
+    BrokerAddress owner;
+    get_topic_owner(topic_index, &owner);
+
+    char moved[MAX_NAME_LENGTH + MAX_HOST_LENGTH + 32];
+    int len = snprintf(moved, sizeof(moved), "MOVED %s %s %d\n", topics[topic_index].name, owner.host, owner.subscriber_port);
+    send_line(subscriber, moved, len);
+    printf("Redirected subscriber for topic '%s' to broker %d\n", topics[topic_index].name, owner.id);
+}
+
+// Function to check whether a subscriber has subscribed to a topic
+int subscriber_has_topic(Subscriber *subscriber, const char *name)
+{
+    for (int i = 0; i < subscriber->topic_count; i++)
+    {
+        if (strcmp(subscriber->topics[i], name) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Assignment strategy: hand articles to the candidates in turn
+int assign_round_robin(ConsumerGroup *group, Subscriber **candidates, int candidate_count, cJSON *article)
+{
+    (void)candidates;
+    (void)article;
+    return group->next_member++ % candidate_count;
+}
+
+// Assignment strategy: hand each article to the candidate with the fewest unacked articles
+int assign_least_outstanding(ConsumerGroup *group, Subscriber **candidates, int candidate_count, cJSON *article)
+{
+    (void)group;
+    (void)article;
+    int best = 0;
+    for (int i = 1; i < candidate_count; i++)
+    {
+        if (candidates[i]->outstanding < candidates[best]->outstanding)
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Assignment strategy: hash the article's "key" field, or its source if it has none, so the articles of a key are
+// consumed in order by one member (without keys that is one member per topic, as the source names the topic)
+int assign_key_hash(ConsumerGroup *group, Subscriber **candidates, int candidate_count, cJSON *article)
+{
+    (void)group;
+    (void)candidates;
+    cJSON *field = cJSON_GetObjectItem(article, "key");
+    if (!cJSON_IsString(field))
+    {
+        cJSON *source = cJSON_GetObjectItem(article, "source");
+        field = source != NULL ? cJSON_GetObjectItem(source, "name") : NULL;
+    }
+    const char *key = cJSON_IsString(field) ? field->valuestring : "";
+
+    unsigned long hash = 5381; // djb2
+    for (const char *c = key; *c != '\0'; c++)
+    {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    return hash % candidate_count;
+}
+
+// Assignment strategies a consumer group can be created with, the first one is the default
+const AssignmentStrategy assignment_strategies[] = {
+    {"round-robin", assign_round_robin},
+    {"least-outstanding", assign_least_outstanding},
+    {"key-hash", assign_key_hash},
+};
+const int assignment_strategy_count = sizeof(assignment_strategies) / sizeof(assignment_strategies[0]);
+
+// Function to put back every article a member was given but hasn't sent yet, so it gets reassigned
+// Must be called with the group mutex held
+void unassign_pending_articles(ConsumerGroup *group, Subscriber *member, int include_sent)
+{
+    for (int t = 0; t < topic_count; t++)
+    {
+        for (int j = group->acked_below[t]; j < MAX_DATA; j++)
+        {
+            Subscriber *owner = group->owner[t][j];
+            int state = group->state[t][j];
+            if (owner == NULL || (member != NULL && owner != member))
+            {
+                continue;
+            }
+            if (state == DELIVERY_ASSIGNED || (include_sent && state == DELIVERY_SENT))
+            {
+                group->state[t][j] = DELIVERY_UNASSIGNED;
+                group->owner[t][j] = NULL;
+                owner->outstanding--;
+            }
+        }
+    }
+}
+
+// Function to add a subscriber to a consumer group, creating the group if needed
+// Returns the group, or NULL if the strategy is unknown or the group is full
+ConsumerGroup *join_consumer_group(Subscriber *subscriber, const char *name, const char *strategy_name)
+{
+    const AssignmentStrategy *strategy = &assignment_strategies[0];
+    if (strategy_name != NULL)
+    {
+        strategy = NULL;
+        for (int i = 0; i < assignment_strategy_count; i++)
+        {
+            if (strcmp(assignment_strategies[i].name, strategy_name) == 0)
+            {
+                strategy = &assignment_strategies[i];
+            }
+        }
+        if (strategy == NULL)
+        {
+            fprintf(stderr, "Unknown assignment strategy: %s\n", strategy_name);
+            return NULL;
+        }
+    }
+
+    ConsumerGroup *group = NULL;
+    pthread_mutex_lock(&consumer_groups_mutex);
+    for (int i = 0; i < consumer_group_count; i++)
+    {
+        if (strcmp(consumer_groups[i].name, name) == 0)
+        {
+            group = &consumer_groups[i];
+            break;
+        }
+    }
+    if (group == NULL && consumer_group_count < MAX_CONSUMER_GROUPS)
+    {
+        // The first member decides the strategy of the group
+        group = &consumer_groups[consumer_group_count++];
+        memset(group, 0, sizeof(*group));
+        strncpy(group->name, name, MAX_NAME_LENGTH - 1);
+        group->strategy = strategy;
+        pthread_mutex_init(&group->mutex, NULL);
+    }
+    pthread_mutex_unlock(&consumer_groups_mutex);
+
+    if (group == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&group->mutex);
+    if (group->member_count == MAX_GROUP_MEMBERS)
+    {
+        pthread_mutex_unlock(&group->mutex);
+        return NULL;
+    }
+    group->members[group->member_count++] = subscriber;
+
+    // Rebalance: articles not yet sent are spread again, now including the new member
+    unassign_pending_articles(group, NULL, 0);
+    pthread_mutex_unlock(&group->mutex);
+
+    printf("Subscriber joined consumer group '%s' (%s, %d members)\n", group->name, group->strategy->name, group->member_count);
+    return group;
+}
+
+// Function to remove a subscriber from its consumer group
+// Whatever it was given and didn't ack is handed to the remaining members
+void leave_consumer_group(Subscriber *subscriber)
+{
+    ConsumerGroup *group = subscriber->group;
+    if (group == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&group->mutex);
+    for (int i = 0; i < group->member_count; i++)
+    {
+        if (group->members[i] == subscriber)
+        {
+            group->members[i] = group->members[--group->member_count];
+            break;
+        }
+    }
+    unassign_pending_articles(group, subscriber, 1);
+    pthread_mutex_unlock(&group->mutex);
+
+    notify_new_data(); // Let the remaining members pick up the reassigned articles
+}
+
+// Function to assign the group's unassigned articles of a topic and send the ones given to this member
+// Returns the no of articles sent, or -1 if the subscriber can no longer be reached
+int send_group_articles(Subscriber *subscriber, int topic_index)
+{
+    ConsumerGroup *group = subscriber->group;
+    Topic *topic = &topics[topic_index];
+    int batch[MAX_GROUP_SEND_BATCH];
+    int batch_count = 0;
+
+    pthread_mutex_lock(&topic->mutex);
+    int data_count = topic->committed_count;
+    pthread_mutex_unlock(&topic->mutex);
+
+    pthread_mutex_lock(&group->mutex);
+
+    // Only members subscribed to this topic can be given its articles
+    Subscriber *candidates[MAX_GROUP_MEMBERS];
+    int candidate_count = 0;
+    for (int i = 0; i < group->member_count; i++)
+    {
+        if (subscriber_has_topic(group->members[i], topic->name))
+        {
+            candidates[candidate_count++] = group->members[i];
+        }
+    }
+
+    for (int j = group->acked_below[topic_index]; j < data_count; j++)
+    {
+        if (group->state[topic_index][j] == DELIVERY_UNASSIGNED && candidate_count > 0)
+        {
+            Subscriber *owner = candidates[group->strategy->assign(group, candidates, candidate_count, topic->data[j])];
+            group->owner[topic_index][j] = owner;
+            group->state[topic_index][j] = DELIVERY_ASSIGNED;
+            owner->outstanding++;
+        }
+        if (group->owner[topic_index][j] == subscriber && group->state[topic_index][j] == DELIVERY_ASSIGNED &&
+            batch_count < MAX_GROUP_SEND_BATCH)
+        {
+            group->state[topic_index][j] = DELIVERY_SENT;
+            batch[batch_count++] = j;
+        }
+    }
+    pthread_mutex_unlock(&group->mutex);
+
+    // Stored articles are never modified or removed, so they can be sent without holding a lock
+    for (int i = 0; i < batch_count; i++)
+    {
+        if (!queue_article(subscriber, topic, batch[i]))
+        {
+            return -1;
+        }
+        printf("Sent data #%d for topic: %s (group %s)\n", batch[i] + 1, topic->name, group->name);
+    }
+    if (flush_due(subscriber) && !flush_articles(subscriber))
+    {
+        return -1;
+    }
+    return batch_count;
+}
+
+// Function to record a member's ack of one article of a topic of its consumer group
+// Members ack every article they got, as articles handed over from a member that left can be older than ones acked before
+void ack_group_article(Subscriber *subscriber, int topic_index, int seq)
+{
+    ConsumerGroup *group = subscriber->group;
+    int j = seq - 1;
+
+    pthread_mutex_lock(&group->mutex);
+    if (j >= 0 && j < MAX_DATA && group->owner[topic_index][j] == subscriber && group->state[topic_index][j] == DELIVERY_SENT)
+    {
+        group->state[topic_index][j] = DELIVERY_ACKED;
+        subscriber->outstanding--;
+    }
+    while (group->acked_below[topic_index] < MAX_DATA &&
+           group->state[topic_index][group->acked_below[topic_index]] == DELIVERY_ACKED)
+    {
+        group->acked_below[topic_index]++;
+    }
+    pthread_mutex_unlock(&group->mutex);
+}
+
+// Function to record an acknowledgement ("ACK <topic> <seq>") from a subscriber
+// Durable subscriptions ack cumulatively (everything up to seq), consumer group members ack the one article
+void process_ack(Subscriber *subscriber, char *line)
+{
+    char topic_name[MAX_NAME_LENGTH];
+    int seq;
+
+    if (sscanf(line, "ACK %63s %d", topic_name, &seq) != 2)
+    {
+        fprintf(stderr, "Malformed control message from subscriber: %s\n", line);
+        return;
+    }
+
+    int topic_index = find_topic_index(topic_name);
+    if (topic_index < 0)
+    {
+        return;
+    }
+
+    if (subscriber->group != NULL)
+    {
+        ack_group_article(subscriber, topic_index, seq);
+        return;
+    }
+    if (subscriber->durable == NULL)
+    {
+        return; // Ephemeral subscriptions don't track offsets
+    }
+
+    // Acks are cumulative, so only ever move the offset forward
+    pthread_mutex_lock(&durable_mutex);
+    if (seq > subscriber->durable->acked_seq[topic_index])
+    {
+        subscriber->durable->acked_seq[topic_index] = seq;
+    }
+    pthread_mutex_unlock(&durable_mutex);
+}
+
+// Function to read and process pending control lines from a subscriber
+// Returns 0 when the subscriber has disconnected, 1 otherwise
+int read_subscriber_acks(Subscriber *subscriber, int flags)
+{
+    int bytes_received = recv(subscriber->sockfd, subscriber->inbuf + subscriber->inbuf_len,
+                              sizeof(subscriber->inbuf) - subscriber->inbuf_len - 1, flags);
+    if (bytes_received == 0)
+    {
+        return 0;
+    }
+    if (bytes_received < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    subscriber->inbuf_len += bytes_received;
+    subscriber->inbuf[subscriber->inbuf_len] = '\0';
+
+    // Process every complete line, keep the remainder for the next read
+    char *line = subscriber->inbuf;
+    char *newline;
+    while ((newline = strchr(line, '\n')) != NULL)
+    {
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r')
+        {
+            newline[-1] = '\0';
+        }
+        if (*line != '\0')
+        {
+            process_ack(subscriber, line);
+        }
+        line = newline + 1;
+    }
+    subscriber->inbuf_len -= line - subscriber->inbuf;
+    memmove(subscriber->inbuf, line, subscriber->inbuf_len);
+
+    // A line longer than the buffer can never complete, so drop it
+    if (subscriber->inbuf_len == sizeof(subscriber->inbuf) - 1)
+    {
+        subscriber->inbuf_len = 0;
+    }
+    return 1;
+}
+
+// Function to add a new subscriber to a topic
+void add_subscriber_to_topic(Topic *topic, Subscriber *subscriber)
+{
+    pthread_mutex_lock(&topic->mutex);
+    if (topic->subscriber_count < MAX_SUBSCRIBERS)
+    {
+        topic->subscribers[topic->subscriber_count++] = subscriber;
+    }
+    pthread_mutex_unlock(&topic->mutex);
+}
+
+// Function to add new data to a topic, or forward it to the owning broker if this broker doesn't own the topic
+// Data forwarded by another broker is always stored, so brokers with different maps can't bounce it around
+void route_data_to_topic(int topic_index, cJSON *data, int forwarded, int priority, long long received_us)
+{
+    Topic *topic = &topics[topic_index];
+
+    // The topic mutex keeps the article behind any migrated history queued for the same broker
+    pthread_mutex_lock(&topic->mutex);
+    if (!forwarded && !owns_topic(topic_index))
+    {
+        BrokerAddress owner;
+        get_topic_owner(topic_index, &owner);
+        size_t len;
+        char *line = forwarded_line(data, &len);
+        if (line != NULL)
+        {
+            // Sent by the owner's forwarding thread (or its follower's); the router never waits for another broker,
+            // which could be waiting for this one, so a full queue drops the article
+            queue_forward(owner.id, line, len, 0);
+        }
+        pthread_mutex_unlock(&topic->mutex);
+        cJSON_Delete(data);
+        return;
+    }
+
+    int stored = -1;
+    if (topic->data_count < MAX_DATA)
+    {
+        // Sequence numbers start at 1, so an acked seq of 0 means nothing was consumed yet
+        // Migrated articles carry the seq of their old owner, renumber them for this broker
+        cJSON_DeleteItemFromObject(data, "seq");
+        cJSON_AddNumberToObject(data, "seq", topic->data_count + 1);
+        topic->data[topic->data_count] = data;
+        topic->priority_of[topic->data_count] = priority;
+        topic->received_us[topic->data_count] = received_us;
+        stored = topic->data_count++;
+        append_to_segment(topic);
+        encode_stored_article(topic);
+        update_committed_count(topic_index);
+    }
+    else
+    {
+        fprintf(stderr, "Topic '%s' is full. Dropping data.\n", topic->name);
+        cJSON_Delete(data);
+    }
+    pthread_mutex_unlock(&topic->mutex);
+
+    // Indexed outside the topic mutex (stored articles never change), queries only see it once committed anyway
+    if (stored >= 0)
+    {
+        search_index_add(&topic->search, stored, data);
+    }
+
+    notify_new_data(); // Wake up waiting subscribers
+}
+
+// Function to queue a received article in the ingest lane of its priority class
+// Blocks while that lane is full, pushing back on the publisher
+void enqueue_article(cJSON *article, int topic_index, int forwarded, long long received_us)
+{
+    int priority = article_priority(article, topic_index);
+    IngestLane *lane = &ingest_lanes[priority];
+
+    pthread_mutex_lock(&ingest_mutex);
+    while (lane->count == MAX_INGEST_QUEUE)
+    {
+        pthread_cond_wait(&ingest_cond, &ingest_mutex);
+    }
+    IngestItem *item = &lane->items[(lane->head + lane->count) % MAX_INGEST_QUEUE];
+    item->article = article;
+    item->topic_index = topic_index;
+    item->forwarded = forwarded;
+    item->priority = priority;
+    item->received_us = received_us;
+    lane->count++;
+    ingest_pending++;
+    pthread_cond_broadcast(&ingest_cond);
+    pthread_mutex_unlock(&ingest_mutex);
+}
+
+// Function to route queued articles to their topics, taking the lanes in weighted priority order
+// Runs in its own thread, so an urgent article overtakes the routine ones queued before it
+void *route_ingested_articles(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&ingest_mutex);
+        int lane_index;
+        while (1)
+        {
+            int has_work[PRIORITY_CLASSES];
+            for (int c = 0; c < PRIORITY_CLASSES; c++)
+            {
+                has_work[c] = ingest_lanes[c].count > 0;
+            }
+            // Ingest credits count articles rather than quanta, routing one article is cheap
+            if ((lane_index = pick_lane(ingest_credits, has_work)) >= 0)
+            {
+                break;
+            }
+            pthread_cond_wait(&ingest_cond, &ingest_mutex);
+        }
+        IngestLane *lane = &ingest_lanes[lane_index];
+        IngestItem item = lane->items[lane->head];
+        lane->head = (lane->head + 1) % MAX_INGEST_QUEUE;
+        lane->count--;
+        pthread_cond_broadcast(&ingest_cond); // Room for a blocked publisher
+        pthread_mutex_unlock(&ingest_mutex);
+
+        route_data_to_topic(item.topic_index, item.article, item.forwarded, item.priority, item.received_us);
+
+        pthread_mutex_lock(&ingest_mutex);
+        ingest_pending--;
+        pthread_cond_broadcast(&ingest_cond);
+        pthread_mutex_unlock(&ingest_mutex);
+    }
+    return NULL;
+}
+
+// Function to wait until every queued article has been routed
+void wait_for_ingest_drained()
+{
+    pthread_mutex_lock(&ingest_mutex);
+    while (ingest_pending > 0)
+    {
+        pthread_cond_wait(&ingest_cond, &ingest_mutex);
+    }
+    pthread_mutex_unlock(&ingest_mutex);
+}
+
+// Function to process a received article (extract topic and forward to relevant subscribers), takes ownership of it
+void process_article_from_publisher(cJSON *root, long long received_us)
+{
+    cJSON *source = cJSON_GetObjectItem(root, "source");
+    if (source == NULL)
+    {
+        fprintf(stderr, "No source found in JSON\n");
+        cJSON_Delete(root);
+        return;
+    }
+
+    cJSON *name = cJSON_GetObjectItem(source, "name");
+    if (name == NULL)
+    {
+        fprintf(stderr, "No name found in source\n");
+        cJSON_Delete(root);
+        return;
+    }
+
+    // Find the topic based on the name provided by the publisher
+    int topic_index = find_topic_index(name->valuestring);
+
+    // If the topic doesn't exist, print an error and do nothing
+    if (topic_index < 0)
+    {
+        fprintf(stderr, "Topic '%s' does not exist. No data will be added.\n", name->valuestring);
+        cJSON_Delete(root); // Clean up the JSON object
+        return;
+    }
+
+    // Data forwarded by another broker is stored without the forwarding marker
+    int forwarded = cJSON_GetObjectItem(root, "forwarded_by") != NULL;
+    cJSON_DeleteItemFromObject(root, "forwarded_by");
+
+    // Queue the data in its priority lane, the router adds it to the topic (or forwards it to the broker owning the topic)
+    enqueue_article(root, topic_index, forwarded, received_us);
+}
+
+// Function to process received data (extract topic and forward to relevant subscribers)
+void process_data_from_publisher(const char *json_data, long long received_us)
+{
+    cJSON *root = cJSON_Parse(json_data);
+    if (root == NULL)
+    {
+        fprintf(stderr, "Error parsing JSON\n");
+        return;
+    }
+    process_article_from_publisher(root, received_us);
+}
+
+// Function to process a binary article frame received from a publisher
+void process_frame_from_publisher(const unsigned char *frame, size_t length, long long received_us)
+{
+    cJSON *root = article_decode(frame, length);
+    if (root == NULL)
+    {
+        fprintf(stderr, "Error decoding binary article\n");
+        return;
+    }
+    printf("Received binary article from publisher (%zu bytes)\n", length);
+    process_article_from_publisher(root, received_us);
+}
+
+// Function to tell all subscribers that no more data will arrive, once the publisher's queued articles are stored
+void finish_publishing()
+{
+    wait_for_ingest_drained();
+    pthread_mutex_lock(&new_data_mutex);
+    publisher_done = 1;
+    pthread_mutex_unlock(&new_data_mutex);
+    notify_new_data();
+}
+
+// Function to handle incoming connections from the publisher
+// Publishers send one JSON article per line (or binary article frames); other brokers first send a "BROKER <id>" line,
+// and a leader replicating to this broker sends "REPLICATE <id>"
+void *handle_publisher(void *arg)
+{
+    int publisher_sockfd = *((int *)arg);
+    char buffer[MAX_BUFFER_SIZE];
+    int buffer_len = 0;
+    int bytes_received;
+    int from_broker = 0;
+    int leader_id = -1; // Set when this is a replication stream
+    free(arg);
+
+    // Receive and process data from the publisher
+    while ((bytes_received = recv(publisher_sockfd, buffer + buffer_len, sizeof(buffer) - buffer_len - 1, 0)) > 0)
+    {
+        buffer_len += bytes_received;
+        buffer[buffer_len] = '\0'; // Null-terminate the received string
+
+        // Process every complete line or frame, keep a partial one for the next recv
+        char *line = buffer;
+        char *newline;
+        int replicated[MAX_TOPICS] = {0};
+        while (line < buffer + buffer_len)
+        {
+            if (*line == ARTICLE_FRAME_MARKER)
+            {
+                long frame_length = article_frame_length((unsigned char *)line, buffer + buffer_len - line);
+                if (frame_length == 0)
+                {
+                    break;
+                }
+                if (frame_length < 0)
+                {
+                    // Can't tell where the next frame starts, drop what was received
+                    fprintf(stderr, "Invalid binary frame, dropping received data\n");
+                    line = buffer + buffer_len;
+                    break;
+                }
+                process_frame_from_publisher((unsigned char *)line, frame_length, now_us());
+                line += frame_length;
+                continue;
+            }
+
+            if ((newline = memchr(line, '\n', buffer + buffer_len - line)) == NULL)
+            {
+                break;
+            }
+            *newline = '\0';
+            if (strncmp(line, "BROKER ", 7) == 0)
+            {
+                from_broker = 1;
+                printf("Broker %s connected to forward data\n", line + 7);
+            }
+            else if (strncmp(line, "REPLICATE ", 10) == 0 && atoi(line + 10) >= 0 && atoi(line + 10) < MAX_BROKERS)
+            {
+                from_broker = 1;
+                int replicating_id = atoi(line + 10);
+
+                // Once its topics were taken over, the old leader is fenced off: it must not feed them any more
+                pthread_mutex_lock(&partition_mutex);
+                int refused = promoted[replicating_id];
+                if (!refused)
+                {
+                    replication_streams[replicating_id]++;
+                }
+                pthread_mutex_unlock(&partition_mutex);
+                if (refused)
+                {
+                    printf("Refused replication from leader %d, its topics were taken over\n", replicating_id);
+                    send(publisher_sockfd, "FENCED\n", 7, MSG_NOSIGNAL);
+                    shutdown(publisher_sockfd, SHUT_RDWR);
+                    break;
+                }
+                leader_id = replicating_id;
+                printf("Leader %d connected to replicate data\n", leader_id);
+
+                // Tell the leader what is already here, so only the gap is sent
+                char reply[MAX_TOPICS * (MAX_NAME_LENGTH + 16) + 8];
+                int reply_len = 0;
+                for (int i = 0; i < topic_count; i++)
+                {
+                    pthread_mutex_lock(&topics[i].mutex);
+                    reply_len += snprintf(reply + reply_len, sizeof(reply) - reply_len, "ACK %s %d\n", topics[i].name, topics[i].data_count);
+                    pthread_mutex_unlock(&topics[i].mutex);
+                }
+                reply_len += snprintf(reply + reply_len, sizeof(reply) - reply_len, "READY\n");
+                send(publisher_sockfd, reply, reply_len, MSG_NOSIGNAL);
+            }
+            else if (leader_id >= 0 && strncmp(line, "TRUNCATE ", 9) == 0)
+            {
+                // The leader gave the topic up since, and dropped its articles
+                int topic_index = find_topic_index(line + 9);
+                if (topic_index >= 0)
+                {
+                    pthread_mutex_lock(&topics[topic_index].mutex);
+                    clear_topic(topic_index);
+                    pthread_mutex_unlock(&topics[topic_index].mutex);
+                    replicated[topic_index] = 1;
+                }
+            }
+            else if (leader_id >= 0 && *line != '\0')
+            {
+                int topic_index = apply_replicated_article(line);
+                if (topic_index >= 0)
+                {
+                    replicated[topic_index] = 1;
+                }
+            }
+            else if (*line != '\0')
+            {
+                printf("Received data from publisher: %s\n", line);
+                process_data_from_publisher(line, now_us()); // Process the data and forward to relevant topics/subscribers
+            }
+            line = newline + 1;
+        }
+        buffer_len -= line - buffer;
+        memmove(buffer, line, buffer_len);
+
+        // An article that doesn't fit in the buffer can't be parsed, drop it
+        if (buffer_len == sizeof(buffer) - 1)
+        {
+            fprintf(stderr, "Article too large, dropping it\n");
+            buffer_len = 0;
+        }
+
+        // Acknowledge replicated articles once per received batch
+        if (leader_id >= 0)
+        {
+            char acks[MAX_TOPICS * (MAX_NAME_LENGTH + 16)];
+            int acks_len = 0;
+            for (int i = 0; i < topic_count; i++)
+            {
+                if (replicated[i])
+                {
+                    pthread_mutex_lock(&topics[i].mutex);
+                    acks_len += snprintf(acks + acks_len, sizeof(acks) - acks_len, "ACK %s %d\n", topics[i].name, topics[i].data_count);
+                    pthread_mutex_unlock(&topics[i].mutex);
+                }
+            }
+            if (acks_len > 0)
+            {
+                send(publisher_sockfd, acks, acks_len, MSG_NOSIGNAL);
+                notify_new_data();
+            }
+        }
+    }
+
+    close(publisher_sockfd);
+
+    // The leader's replication stream went away, take over its topics unless the leader is still there
+    if (leader_id >= 0)
+    {
+        pthread_mutex_lock(&partition_mutex);
+        replication_streams[leader_id]--;
+        pthread_mutex_unlock(&partition_mutex);
+        watch_leader(leader_id);
+        return NULL;
+    }
+
+    // Another broker going away doesn't mean the publisher is done
+    if (from_broker)
+    {
+        printf("Forwarding broker disconnected\n");
+        return NULL;
+    }
+
+    // Publisher disconnected
+    printf("Publisher disconnected\n");
+    finish_publishing();
+    return NULL;
+}
+
+// Function to handle the subscription request from the subscriber
+// Format: "[<prefix>:]<topic>[@<seq>],<topic>[@<seq>],..." where the prefix is either
+//   <name>                    a durable subscription resuming after its last ack
+//   @<group>[/<strategy>]     membership of a consumer group sharing the articles
+// and a topic's <seq> is the last one the subscriber processed (e.g. before failing over to this broker)
+// A leading "BINARY " asks for the articles as binary frames rather than JSON lines
+// Returns 0 if the request was rejected
+int request_subscription(Subscriber *subscriber, char *buffer)
+{
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+    if (strncmp(buffer, "BINARY ", 7) == 0)
+    {
+        subscriber->binary = 1;
+        buffer += 7;
+    }
+
+    char *topic_list = buffer;
+    char *group_name = NULL;
+    char *separator = strchr(buffer, ':');
+    if (separator != NULL && buffer[0] == '@')
+    {
+        *separator = '\0';
+        topic_list = separator + 1;
+        group_name = buffer + 1; // Joined once the topics are known
+    }
+    else if (separator != NULL)
+    {
+        *separator = '\0';
+        topic_list = separator + 1;
+
+        subscriber->durable = attach_durable_subscription(buffer);
+        if (subscriber->durable == NULL)
+        {
+            fprintf(stderr, "Durable subscription '%s' is unavailable (limit reached)\n", buffer);
+            return 0;
+        }
+        printf("Subscriber attached to durable subscription: %s\n", buffer);
+    }
+
+    // Parse the topics and add the subscriber to those topics
+    char *token = strtok(topic_list, ",");
+    while (token != NULL && subscriber->topic_count < MAX_TOPICS)
+    {
+        int resume_seq = -1;
+        char *position = strchr(token, '@');
+        if (position != NULL)
+        {
+            *position = '\0';
+            resume_seq = atoi(position + 1);
+        }
+
+        int i = find_topic_index(token);
+        if (i >= 0 && !owns_topic(i))
+        {
+            // The topic is served by another broker, point the subscriber there
+            send_moved(subscriber, i);
+        }
+        else if (i >= 0 && subscriber->durable != NULL && !claim_durable_topic(subscriber->durable, i))
+        {
+            fprintf(stderr, "Topic '%s' of durable subscription '%s' is in use\n", token, subscriber->durable->name);
+            return 0;
+        }
+        else if (i >= 0)
+        {
+            // Add the subscriber to the topic
+            add_subscriber_to_topic(&topics[i], subscriber);
+            // Store the topic in the subscriber's list of topics, resuming after the last acked article
+            subscriber->topics[subscriber->topic_count] = topics[i].name;
+            subscriber->next_index[subscriber->topic_count] = 0;
+            if (resume_seq >= 0)
+            {
+                subscriber->next_index[subscriber->topic_count] = resume_seq;
+            }
+            else if (subscriber->durable != NULL)
+            {
+                pthread_mutex_lock(&durable_mutex);
+                subscriber->next_index[subscriber->topic_count] = subscriber->durable->acked_seq[i];
+                pthread_mutex_unlock(&durable_mutex);
+            }
+            printf("Subscriber subscribed to topic: %s (resuming at seq %d)\n", token,
+                   subscriber->next_index[subscriber->topic_count] + 1);
+            subscriber->topic_count++;
+        }
+        token = strtok(NULL, ",");
+    }
+
+    if (group_name != NULL)
+    {
+        char *strategy_name = strchr(group_name, '/');
+        if (strategy_name != NULL)
+        {
+            *strategy_name++ = '\0';
+        }
+        subscriber->group = join_consumer_group(subscriber, group_name, strategy_name);
+        if (subscriber->group == NULL)
+        {
+            fprintf(stderr, "Consumer group '%s' is unavailable (bad strategy or limit reached)\n", group_name);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to find the lane of a subscribed topic's pending articles: the most urgent class among them
+// A topic's articles must go out in order (acks are cumulative), so an urgent article takes the ones before it along
+// Must be called with the topic mutex held; returns -1 if nothing is pending
+int pending_lane(Subscriber *subscriber, int i, Topic *topic)
+{
+    int lane = -1;
+    for (int j = subscriber->next_index[i]; j < topic->committed_count && lane != PRIORITY_URGENT; j++)
+    {
+        if (lane < 0 || topic->priority_of[j] < lane)
+        {
+            lane = topic->priority_of[j];
+        }
+    }
+    return lane;
+}
+
+// Function to send up to max_count pending articles of the subscriber's i-th topic
+// Returns the no of articles sent, or -1 if the subscriber can no longer be reached
+int send_topic_articles(Subscriber *subscriber, int i, Topic *topic, int max_count)
+{
+    pthread_mutex_lock(&topic->mutex);
+    int first = subscriber->next_index[i];
+    int last = topic->committed_count;
+    if (last - first > max_count)
+    {
+        last = first + max_count;
+    }
+
+    // (A local subscriber's ring can't be fed by sendfile, and the segment holds JSON lines rather than binary frames)
+    if (topic->segment_fd >= 0 && last - first >= REPLAY_MIN_ARTICLES && subscriber->ring == NULL && !subscriber->binary)
+    {
+        // Catching up on stored history: send it straight from the segment file, without the topic lock
+        // Articles queued before go out first, so the subscriber still gets every topic in order
+        int segment_fd = topic->segment_fd;
+        off_t start = topic->offsets[first];
+        off_t end = topic->offsets[last];
+        pthread_mutex_unlock(&topic->mutex);
+        if (!flush_articles(subscriber))
+        {
+            return -1;
+        }
+        set_cork(subscriber, 1);
+        if (!send_from_segment(subscriber->sockfd, segment_fd, start, end))
+        {
+            perror("Failed to send data to subscriber");
+            return -1;
+        }
+        printf("Replayed data #%d-#%d for topic: %s\n", first + 1, last, topic->name);
+
+        // Stored articles never change, their timestamps can be read without the lock
+        long long sent_us = now_us();
+        for (int j = first; j < last; j++)
+        {
+            record_latency(subscriber, topic, j, sent_us);
+        }
+    }
+    else
+    {
+        for (int j = first; j < last; j++)
+        {
+            if (!queue_article(subscriber, topic, j))
+            {
+                pthread_mutex_unlock(&topic->mutex);
+                return -1;
+            }
+            printf("Sent data #%d for topic: %s\n", j + 1, topic->name);
+        }
+        pthread_mutex_unlock(&topic->mutex);
+        if (flush_due(subscriber) && !flush_articles(subscriber))
+        {
+            return -1;
+        }
+    }
+
+    subscriber->next_index[i] = last;
+    return last - first;
+}
+
+// Function to wait for data on subscribed topics and send it to the subscriber
+// Streams until the publisher is done and every subscribed topic has been committed and delivered
+// Returns 0 if the subscriber disconnected before that
+int wait_for_data_and_send(Subscriber *subscriber)
+{
+    while (1)
+    {
+        int sent = 0;
+        int uncommitted = 0; // Whether articles are still waiting for replication
+        int done = publisher_done; // Read before sending, so data published just before "done" isn't missed
+        unsigned long generation = get_data_generation();
+
+        // The partitions of some topics were moved away, redirect the subscriber and stop serving them here
+        for (int i = 0; i < subscriber->topic_count; i++)
+        {
+            int topic_index = find_topic_index(subscriber->topics[i]);
+            if (topic_index >= 0 && !owns_topic(topic_index))
+            {
+                send_moved(subscriber, topic_index);
+                release_durable_topic(subscriber->durable, topic_index); // The subscriber may come back for it
+                subscriber->topic_count--;
+                for (int k = i; k < subscriber->topic_count; k++)
                 {
-                    perror("Publisher accept failed");
-                    continue;
+                    subscriber->topics[k] = subscriber->topics[k + 1];
+                    subscriber->next_index[k] = subscriber->next_index[k + 1];
                 }
+                i--;
+            }
+        }
 
-                // Handle publisher in a separate thread
-                pthread_t publisher_thread;
-                pthread_create(&publisher_thread, NULL, handle_publisher, (void *)&new_sock_publisher);
+        // Consumer group members only get the articles assigned to them, taken topic by topic in lane order
+        if (subscriber->group != NULL)
+        {
+            for (int c = 0; c < PRIORITY_CLASSES; c++)
+            {
+                for (int i = 0; i < subscriber->topic_count; i++)
+                {
+                    int topic_index = find_topic_index(subscriber->topics[i]);
+                    if (topic_index < 0 || topics[topic_index].priority != c)
+                    {
+                        continue;
+                    }
+                    int group_sent = send_group_articles(subscriber, topic_index);
+                    if (group_sent < 0)
+                    {
+                        return 0;
+                    }
+                    sent += group_sent;
+                }
             }
-            else if (events[i].data.fd == server_fd_subscriber)
+        }
+
+        // Send whatever is new in the subscribed topics, one lane quantum at a time
+        // Lanes are picked again after every quantum, so urgent articles arriving meanwhile don't wait for a long backlog
+        while (subscriber->group == NULL)
+        {
+            int lane[MAX_TOPICS];
+            int has_work[PRIORITY_CLASSES] = {0};
+            for (int i = 0; i < subscriber->topic_count; i++)
             {
-                // Handle subscriber connection
-                printf("Handling a new subscriber\n");
-                new_sock_subscriber = accept(server_fd_subscriber, (struct sockaddr *)&address_subscriber, (socklen_t *)&addrlen_subscriber);
-                if (new_sock_subscriber < 0)
+                int topic_index = find_topic_index(subscriber->topics[i]);
+                lane[i] = -1;
+                if (topic_index < 0)
                 {
-                    perror("Subscriber accept failed");
                     continue;
                 }
+                Topic *topic = &topics[topic_index];
+                pthread_mutex_lock(&topic->mutex);
+                uncommitted |= topic->committed_count < topic->data_count;
+                lane[i] = pending_lane(subscriber, i, topic);
+                pthread_mutex_unlock(&topic->mutex);
+                if (lane[i] >= 0)
+                {
+                    has_work[lane[i]] = 1;
+                }
+            }
+
+            int c = pick_lane(subscriber->lane_credits, has_work);
+            if (c < 0)
+            {
+                break;
+            }
+
+            // Topics sharing a lane take turns
+            int i = 0;
+            for (int k = 0; k < subscriber->topic_count; k++)
+            {
+                i = (subscriber->lane_cursor + k) % subscriber->topic_count;
+                if (lane[i] == c)
+                {
+                    break;
+                }
+            }
+            subscriber->lane_cursor = i + 1;
+
+            int topic_sent = send_topic_articles(subscriber, i, &topics[find_topic_index(subscriber->topics[i])], LANE_QUANTUM);
+            if (topic_sent < 0)
+            {
+                return 0;
+            }
+            sent += topic_sent;
+        }
+
+        // Write the pending batch once it is due, or right away when the stream is about to end
+        if ((flush_due(subscriber) || (sent == 0 && done && !uncommitted)) && !flush_articles(subscriber))
+        {
+            return 0;
+        }
+        if (subscriber->pending_count == 0)
+        {
+            set_cork(subscriber, 0); // Caught up, let the kernel send everything it was holding
+        }
+
+        // Pick up any acks that arrived meanwhile
+        if (!read_subscriber_acks(subscriber, MSG_DONTWAIT))
+        {
+            return 0;
+        }
+
+        if (sent == 0)
+        {
+            if (done && !uncommitted)
+            {
+                return 1;
+            }
+
+            // Articles held back for batching wait no longer than what is left of the budget
+            long timeout_us = WAIT_TIMEOUT_MS * 1000;
+            if (subscriber->pending_count > 0)
+            {
+                timeout_us = subscriber->pending_since_us + subscriber->budget_us - now_us();
+            }
+            wait_for_new_data(generation, timeout_us);
+        }
+    }
+}
+
+// Function to parse the bound of a query's time range: a timestamp like "2024-11-13T16:34:06Z", or "-" for open
+int parse_query_time(const char *string, long long open_value, long long *seconds)
+{
+    if (strcmp(string, "-") == 0)
+    {
+        *seconds = open_value;
+        return 1;
+    }
+    return article_parse_timestamp(string, seconds);
+}
+
+// Function to answer a historical query: "QUERY <topic> <from> <to> [<term> ...]"
+// Matches the stored articles published between from and to (inclusive) mentioning every term (in title or
+// description), oldest first. They are streamed in pages, each a "PAGE <no> <count>" line followed by that many
+// articles, and "END <total>" closes the results. The index is only locked while matching, never while sending
+void handle_query(Subscriber *subscriber, char *request)
+{
+    request[strcspn(request, "\r\n")] = '\0';
+    char *save;
+    strtok_r(request, " ", &save); // "QUERY"
+    char *topic_name = strtok_r(NULL, " ", &save);
+    char *from_string = strtok_r(NULL, " ", &save);
+    char *to_string = strtok_r(NULL, " ", &save);
+    char *terms[SEARCH_MAX_QUERY_TERMS];
+    int term_count = 0;
+    char *term;
+    while ((term = strtok_r(NULL, " ", &save)) != NULL)
+    {
+        // Dropping terms would widen the results, and a term without letters or digits matches no word
+        const char *error = NULL;
+        if (term_count == SEARCH_MAX_QUERY_TERMS)
+        {
+            error = "ERROR too many terms\n";
+        }
+        else if (!search_term_valid(term))
+        {
+            error = "ERROR term without letters or digits\n";
+        }
+        if (error != NULL)
+        {
+            send(subscriber->sockfd, error, strlen(error), MSG_NOSIGNAL);
+            return;
+        }
+        terms[term_count++] = term;
+    }
+
+    long long from, to;
+    int topic_index = topic_name != NULL ? find_topic_index(topic_name) : -1;
+    if (topic_index < 0 || to_string == NULL || !parse_query_time(from_string, LLONG_MIN, &from) ||
+        !parse_query_time(to_string, LLONG_MAX, &to))
+    {
+        const char *error = "ERROR usage: QUERY <topic> <from> <to> [<term> ...]\n";
+        send(subscriber->sockfd, error, strlen(error), MSG_NOSIGNAL);
+        return;
+    }
+    if (!owns_topic(topic_index))
+    {
+        send_moved(subscriber, topic_index);
+        return;
+    }
+    printf("Querying topic '%s' (%d terms)\n", topics[topic_index].name, term_count);
+
+    Topic *topic = &topics[topic_index];
+    pthread_mutex_lock(&topic->mutex);
+    int visible_count = topic->committed_count;
+    pthread_mutex_unlock(&topic->mutex);
+
+    int *results = malloc(MAX_DATA * sizeof(int));
+    int result_count = search_index_query(&topic->search, from, to, terms, term_count, visible_count, results);
+
+    // Stored articles never change, so the pages are built without any lock
+    for (int first = 0, page = 1; first < result_count; first += QUERY_PAGE_SIZE, page++)
+    {
+        int count = result_count - first < QUERY_PAGE_SIZE ? result_count - first : QUERY_PAGE_SIZE;
+        char header[32];
+        char *lines[QUERY_PAGE_SIZE];
+        struct iovec iov[QUERY_PAGE_SIZE + 1];
+        iov[0].iov_base = header;
+        iov[0].iov_len = snprintf(header, sizeof(header), "PAGE %d %d\n", page, count);
+        for (int i = 0; i < count; i++)
+        {
+            lines[i] = cJSON_PrintUnformatted(topic->data[results[first + i]]);
+            size_t len = strlen(lines[i]);
+            lines[i][len] = '\n'; // Overwrite the terminator, the line is sent by length
+            iov[i + 1].iov_base = lines[i];
+            iov[i + 1].iov_len = len + 1;
+        }
+
+        int ok = io_send_batch(subscriber->sender, subscriber->sockfd, iov, count + 1);
+        for (int i = 0; i < count; i++)
+        {
+            free(lines[i]);
+        }
+        if (!ok)
+        {
+            perror("Failed to send query results");
+            free(results);
+            return;
+        }
+    }
+
+    char end[32];
+    int len = snprintf(end, sizeof(end), "END %d\n", result_count);
+    send(subscriber->sockfd, end, len, MSG_NOSIGNAL);
+    free(results);
+}
+
+// Function to handle incoming connections from subscribers
+void *handle_subscriber(void *arg)
+{
+    Subscriber *subscriber = (Subscriber *)arg;
+    char buffer[MAX_BUFFER_SIZE];
+    int bytes_received;
+    subscriber->sender = io_sender_create();
+
+    // Receive and handle subscription information (topics the subscriber is interested in)
+    while ((bytes_received = recv(subscriber->sockfd, buffer, sizeof(buffer) - 1, 0)) > 0)
+    {
+        buffer[bytes_received] = '\0'; // Null-terminate the received string
+
+        // Not a subscription but a request for the per-lane latency stats
+        if (strcmp(buffer, "STATS\n") == 0 || strcmp(buffer, "STATS") == 0)
+        {
+            send_latency_stats(subscriber->sockfd);
+            break;
+        }
+
+        // Or a historical query, answered from the topic's search index
+        if (strncmp(buffer, "QUERY ", 6) == 0)
+        {
+            handle_query(subscriber, buffer);
+            break;
+        }
+        printf("Subscriber requested to subscribe to topics: %s\n", buffer);
+
+        // Request subscription based on the received buffer
+        if (!request_subscription(subscriber, buffer))
+        {
+            close(subscriber->sockfd);
+            io_sender_destroy(subscriber->sender);
+            if (subscriber->ring != NULL)
+            {
+                shm_ring_close(subscriber->ring);
+                free(subscriber->ring);
+            }
+            free(subscriber);
+            return NULL;
+        }
+
+        // After subscription, wait for and send the data for subscribed topics
+        subscriber->subscribed_us = now_us();
+        start_coalescing(subscriber);
+        if (wait_for_data_and_send(subscriber))
+        {
+            // Signal end of stream (so it isn't mistaken for a broker failure), then collect the final acks until the subscriber closes
+            send_line(subscriber, "END\n", 4);
+            if (subscriber->ring != NULL)
+            {
+                shm_ring_finish(subscriber->ring);
+            }
+            shutdown(subscriber->sockfd, SHUT_WR);
+            while (read_subscriber_acks(subscriber, 0))
+                ;
+        }
+
+        break; // Once subscription is handled, we break the loop
+    }
+
+    // Subscriber disconnected
+    printf("Subscriber disconnected\n");
+    detach_durable_subscription(subscriber);
+    leave_consumer_group(subscriber);
+    drop_pending_articles(subscriber);
+    close(subscriber->sockfd);
+    io_sender_destroy(subscriber->sender);
+    if (subscriber->ring != NULL)
+    {
+        shm_ring_close(subscriber->ring);
+        free(subscriber->ring);
+    }
+    free(subscriber);
+    return NULL;
+}
+
+// Function to handle a client on this broker's host, which exchanges articles over a shared-memory ring
+// The Unix domain socket it connected on carries the handshake, a subscriber's request and acks, and hang-ups
+void *handle_local_client(void *arg)
+{
+    int client_fd = *((int *)arg);
+    char role[32];
+    ShmRing *ring = malloc(sizeof(ShmRing));
+    free(arg);
 
-                // Handle subscriber in a separate thread
-                Subscriber *new_subscriber = malloc(sizeof(Subscriber));
-                new_subscriber->sockfd = new_sock_subscriber;
-                new_subscriber->topic_count = 0;
-                pthread_t subscriber_thread;
-                pthread_create(&subscriber_thread, NULL, handle_subscriber, (void *)new_subscriber);
-                pthread_detach(subscriber_thread);
+    if (!shm_accept(client_fd, ring, role, sizeof(role)))
+    {
+        fprintf(stderr, "Local client handshake failed\n");
+        close(client_fd);
+        free(ring);
+        return NULL;
+    }
+
+    if (strcmp(role, SHM_ROLE_SUBSCRIBE) == 0)
+    {
+        printf("Handling a new local subscriber\n");
+        Subscriber *subscriber = calloc(1, sizeof(Subscriber));
+        subscriber->sockfd = client_fd;
+        subscriber->ring = ring;
+        return handle_subscriber(subscriber);
+    }
+
+    // A local publisher writes one article per record, parsed straight out of the ring
+    printf("Local publisher connected\n");
+    char *line;
+    int length;
+    while ((length = shm_ring_read(ring, &line)) > 0)
+    {
+        if (*line == ARTICLE_FRAME_MARKER)
+        {
+            process_frame_from_publisher((unsigned char *)line, length, now_us());
+        }
+        else
+        {
+            printf("Received data from publisher: %s\n", line);
+            process_data_from_publisher(line, now_us());
+        }
+        shm_ring_release(ring);
+    }
+
+    close(client_fd);
+    shm_ring_close(ring);
+    free(ring);
+    printf("Publisher disconnected\n");
+    finish_publishing();
+    return NULL;
+}
+
+// Main function for broker server
+// Usage: ./broker [<broker-id> [<partition-map-file>]]
+int main(int argc, char *argv[])
+{
+    int server_fd_subscriber, server_fd_publisher;
+    struct sockaddr_in address_subscriber, address_publisher;
+
+    if (argc > 1)
+    {
+        broker_id = atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        partition_map_file = argv[2];
+    }
+
+    // Initialize mutexes and condition variables
+    init_topic_mutexes_and_cond();
+
+    // Predefine 3 topics
+    topics[0].name = "Reuters";
+    topics[1].name = "BBC";
+    topics[2].name = "CNN";
+    topic_count = 3;
+
+    // Find out which topics this broker owns
+    if (!load_partition_map(partition_map_file, &partition_map))
+    {
+        exit(1);
+    }
+    const BrokerAddress *self = find_broker(&partition_map, broker_id);
+    if (self == NULL)
+    {
+        fprintf(stderr, "Broker %d is not in the partition map\n", broker_id);
+        exit(1);
+    }
+    int port_subscriber = self->subscriber_port;
+    int port_publisher = self->publisher_port;
+    update_topic_ownership();
+    ack_mode = partition_map.ack_mode;
+    for (int i = 0; i < topic_count; i++)
+    {
+        printf("Topic '%s' is owned by broker %d\n", topics[i].name, find_topic_owner(&partition_map, topics[i].name)->id);
+    }
+    for (int i = 0; i < MAX_BROKERS; i++)
+    {
+        forward_queues[i].sockfd = -1;
+        pthread_cond_init(&forward_queues[i].cond, NULL);
+    }
+    open_topic_segments();
+    for (int i = 0; i < topic_count; i++)
+    {
+        search_index_init(&topics[i].search, MAX_DATA);
+    }
+
+    // Route published articles from the ingest lanes, most urgent first
+    pthread_t router_thread;
+    pthread_create(&router_thread, NULL, route_ingested_articles, NULL);
+    pthread_detach(router_thread);
+
+    // sendfile can't be told MSG_NOSIGNAL, a subscriber going away mid-replay must not kill the broker
+    signal(SIGPIPE, SIG_IGN);
+
+    // Reload the partition map on SIGHUP (without SA_RESTART, so waiting for connections returns to handle it)
+    // SIGHUP stays blocked everywhere except while waiting for connections, so the main thread is the one receiving it
+    struct sigaction reload_action;
+    memset(&reload_action, 0, sizeof(reload_action));
+    reload_action.sa_handler = request_reload;
+    sigaction(SIGHUP, &reload_action, NULL);
+    sigset_t hup_mask, wait_mask;
+    sigemptyset(&hup_mask);
+    sigaddset(&hup_mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup_mask, &wait_mask);
+
+    // Replicate the owned topics to this broker's followers
+    for (int i = 0; i < partition_map.broker_count; i++)
+    {
+        if (partition_map.leader_of[partition_map.brokers[i].id] == broker_id)
+        {
+            Follower *follower = &followers[follower_count++];
+            follower->address = partition_map.brokers[i];
+            follower->sockfd = -1;
+            follower->down_since_us = now_us();
+            pthread_t replication_thread;
+            pthread_create(&replication_thread, NULL, replicate_to_follower, (void *)follower);
+            pthread_detach(replication_thread);
+        }
+    }
+    if (partition_map.leader_of[broker_id] >= 0)
+    {
+        printf("Following broker %d\n", partition_map.leader_of[broker_id]);
+    }
+
+    // Create socket for subscribers
+    if ((server_fd_subscriber = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    {
+        perror("Subscriber socket failed");
+        exit(1);
+    }
+    // Allow restarting a broker right away, while old connections to its ports are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_fd_subscriber, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    address_subscriber.sin_family = AF_INET;
+    address_subscriber.sin_addr.s_addr = INADDR_ANY;
+    address_subscriber.sin_port = htons(port_subscriber);
+
+    if (bind(server_fd_subscriber, (struct sockaddr *)&address_subscriber, sizeof(address_subscriber)) < 0)
+    {
+        perror("Bind failed");
+        exit(1);
+    }
+    if (listen(server_fd_subscriber, 3) < 0)
+    {
+        perror("Listen failed");
+        exit(1);
+    }
+
+    // Create socket for publishers
+    if ((server_fd_publisher = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    {
+        perror("Publisher socket failed");
+        exit(1);
+    }
+    setsockopt(server_fd_publisher, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    address_publisher.sin_family = AF_INET;
+    address_publisher.sin_addr.s_addr = INADDR_ANY;
+    address_publisher.sin_port = htons(port_publisher);
+
+    if (bind(server_fd_publisher, (struct sockaddr *)&address_publisher, sizeof(address_publisher)) < 0)
+    {
+        perror("Bind failed");
+        exit(1);
+    }
+    if (listen(server_fd_publisher, 3) < 0)
+    {
+        perror("Listen failed");
+        exit(1);
+    }
+
+    // Accept connections with io_uring when the kernel supports it (BROKER_IO_BACKEND=epoll forces epoll)
+    const char *requested_backend = getenv("BROKER_IO_BACKEND");
+    io_backend_init(requested_backend == NULL || strcmp(requested_backend, "epoll") != 0);
+    // Clients on this host may also connect over a Unix domain socket and exchange articles over shared memory
+    int server_fd_local = shm_listen(broker_id);
+    int listen_fds[3] = {server_fd_subscriber, server_fd_publisher, server_fd_local};
+    IoListener *listener = io_listener_create(listen_fds, server_fd_local >= 0 ? 3 : 2);
+    if (listener == NULL)
+    {
+        exit(1);
+    }
+
+    printf("Broker %d is running (%s)...\n", broker_id, io_backend_name());
+
+    // Start accepting connections
+    while (1)
+    {
+        int listen_fd = -1;
+        int new_sock = io_listener_accept(listener, &listen_fd, &wait_mask);
+        if (new_sock == -1 && errno == EINTR)
+        {
+            // Interrupted by a signal, e.g. SIGHUP asking to reload the partition map
+            if (reload_requested)
+            {
+                reload_requested = 0;
+                printf("Reloading partition map from %s\n", partition_map_file);
+                reload_partition_map();
+            }
+            continue;
+        }
+        if (listen_fd == -1)
+        {
+            perror("Waiting for connections failed");
+            exit(1);
+        }
+
+        if (listen_fd == server_fd_publisher)
+        {
+            // Handle publisher connection
+            if (new_sock < 0)
+            {
+                perror("Publisher accept failed");
+                continue;
+            }
+
+            // Handle publisher in a separate thread (publishers and forwarding brokers may connect concurrently)
+            int *publisher_sockfd = malloc(sizeof(int));
+            *publisher_sockfd = new_sock;
+            pthread_t publisher_thread;
+            pthread_create(&publisher_thread, NULL, handle_publisher, (void *)publisher_sockfd);
+            pthread_detach(publisher_thread);
+        }
+        else if (listen_fd == server_fd_local)
+        {
+            if (new_sock < 0)
+            {
+                perror("Local accept failed");
+                continue;
+            }
+
+            // The handshake waits on the client, so it happens in the client's thread
+            int *client_fd = malloc(sizeof(int));
+            *client_fd = new_sock;
+            pthread_t local_thread;
+            pthread_create(&local_thread, NULL, handle_local_client, (void *)client_fd);
+            pthread_detach(local_thread);
+        }
+        else
+        {
+            // Handle subscriber connection
+            printf("Handling a new subscriber\n");
+            if (new_sock < 0)
+            {
+                perror("Subscriber accept failed");
+                continue;
             }
+
+            // Handle subscriber in a separate thread
+            Subscriber *new_subscriber = calloc(1, sizeof(Subscriber));
+            new_subscriber->sockfd = new_sock;
+            new_subscriber->topic_count = 0;
+            new_subscriber->durable = NULL;
+            new_subscriber->group = NULL;
+            pthread_t subscriber_thread;
+            pthread_create(&subscriber_thread, NULL, handle_subscriber, (void *)new_subscriber);
+            pthread_detach(subscriber_thread);
         }
     }
 
     // Cleanup
     destroy_topic_mutexes_and_cond();
-    close(epoll_fd);
     return 0;
 }
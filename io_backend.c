@@ -0,0 +1,487 @@
+#include "io_backend.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ACCEPT_ENTRIES 16
+#define URING_SEND_ENTRIES 32
+#define SENDMSG_MAX_IOV 1024 // Buffers per sendmsg call (the kernel's limit)
+
+// Rings shared with the kernel
+typedef struct
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail; // Local tail, published to the kernel on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+} IoRing;
+
+struct IoListener
+{
+    int fds[IO_MAX_LISTENERS];
+    int count;
+    int epoll_fd;
+    IoRing ring;
+    int multishot; // Cleared if the kernel rejects multishot accept
+};
+
+struct IoSender
+{
+    int uring; // 0 if this sender falls back to sendmsg
+    IoRing ring;
+    struct msghdr messages[URING_SEND_ENTRIES]; // Headers of the queued sends, read by the kernel until they complete
+};
+
+static int backend = IO_BACKEND_EPOLL;
+
+// Function to set up an io_uring instance and map its rings
+static int ring_init(IoRing *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_size > ring->sq_size)
+        {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            munmap(ring->sq_ptr, ring->sq_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_ptr != ring->sq_ptr)
+        {
+            munmap(ring->cq_ptr, ring->cq_size);
+        }
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ptr;
+    char *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Function to unmap the rings and close an io_uring instance
+static void ring_destroy(IoRing *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+    {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+// Function to get a zeroed submission queue entry, NULL if the queue is full
+static struct io_uring_sqe *ring_get_sqe(IoRing *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries)
+    {
+        return NULL;
+    }
+
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+// Function to publish queued entries and wait for at least wait_nr completions
+static int ring_enter(IoRing *ring, unsigned wait_nr, const sigset_t *wait_mask)
+{
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    int result = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                         wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, wait_mask, _NSIG / 8);
+    return result < 0 ? -1 : result;
+}
+
+// Function to take the next completion, returns 0 if there is none
+static int ring_pop_cqe(IoRing *ring, struct io_uring_cqe *cqe)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Function to pick the I/O backend: io_uring if allowed and the kernel supports it, epoll otherwise
+int io_backend_init(int allow_uring)
+{
+    backend = IO_BACKEND_EPOLL;
+    if (!allow_uring)
+    {
+        return backend;
+    }
+
+    IoRing probe;
+    if (ring_init(&probe, 2) == 0)
+    {
+        ring_destroy(&probe);
+        backend = IO_BACKEND_URING;
+    }
+    return backend;
+}
+
+// Function to get the name of the backend in use, for logging
+const char *io_backend_name()
+{
+    return backend == IO_BACKEND_URING ? "io_uring" : "epoll";
+}
+
+// Function to queue an accept on a listening socket, multishot if supported
+static int arm_accept(IoListener *listener, int index)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(&listener->ring);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->fds[index];
+    sqe->ioprio = listener->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = index;
+    return 0;
+}
+
+// Function to start accepting connections on listening sockets
+IoListener *io_listener_create(int *listen_fds, int count)
+{
+    if (count > IO_MAX_LISTENERS)
+    {
+        fprintf(stderr, "Too many listening sockets\n");
+        return NULL;
+    }
+
+    IoListener *listener = calloc(1, sizeof(IoListener));
+    memcpy(listener->fds, listen_fds, count * sizeof(int));
+    listener->count = count;
+    listener->epoll_fd = -1;
+    listener->multishot = 1;
+
+    if (backend == IO_BACKEND_URING && ring_init(&listener->ring, URING_ACCEPT_ENTRIES) == 0)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            arm_accept(listener, i);
+        }
+        if (ring_enter(&listener->ring, 0, NULL) >= 0)
+        {
+            return listener;
+        }
+        ring_destroy(&listener->ring);
+    }
+
+    listener->epoll_fd = epoll_create1(0);
+    if (listener->epoll_fd == -1)
+    {
+        perror("Epoll creation failed");
+        free(listener);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        if (epoll_ctl(listener->epoll_fd, EPOLL_CTL_ADD, listen_fds[i], &event) == -1)
+        {
+            perror("Epoll control failed");
+            close(listener->epoll_fd);
+            free(listener);
+            return NULL;
+        }
+    }
+    return listener;
+}
+
+// Function to wait for the next accepted connection, with wait_mask as signal mask while blocked
+int io_listener_accept(IoListener *listener, int *listen_fd, const sigset_t *wait_mask)
+{
+    if (listener->epoll_fd != -1)
+    {
+        struct epoll_event event;
+        int ready = epoll_pwait(listener->epoll_fd, &event, 1, -1, wait_mask);
+        if (ready <= 0)
+        {
+            if (ready == 0)
+            {
+                errno = EINTR;
+            }
+            return -1;
+        }
+
+        *listen_fd = listener->fds[event.data.u32];
+        return accept(*listen_fd, NULL, NULL);
+    }
+
+    *listen_fd = -1;
+    while (1)
+    {
+        struct io_uring_cqe cqe;
+        if (!ring_pop_cqe(&listener->ring, &cqe))
+        {
+            if (ring_enter(&listener->ring, 1, wait_mask) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        int index = (int)cqe.user_data;
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            // Kernels without multishot accept reject it; they get one accept per submission
+            if (cqe.res == -EINVAL && listener->multishot)
+            {
+                listener->multishot = 0;
+            }
+            arm_accept(listener, index);
+            ring_enter(&listener->ring, 0, NULL);
+        }
+
+        *listen_fd = listener->fds[index];
+        if (cqe.res >= 0)
+        {
+            return cqe.res;
+        }
+        if (cqe.res != -EINVAL)
+        {
+            errno = -cqe.res;
+            return -1;
+        }
+    }
+}
+
+// Function to create a sender, used by one thread to write batches of buffers to sockets
+IoSender *io_sender_create()
+{
+    IoSender *sender = calloc(1, sizeof(IoSender));
+    if (backend == IO_BACKEND_URING && ring_init(&sender->ring, URING_SEND_ENTRIES) == 0)
+    {
+        sender->uring = 1;
+    }
+    return sender;
+}
+
+// Function to free a sender
+void io_sender_destroy(IoSender *sender)
+{
+    if (sender->uring)
+    {
+        ring_destroy(&sender->ring);
+    }
+    free(sender);
+}
+
+// Function to skip the bytes already written at the front of a batch, returns the buffers left
+static int skip_written(struct iovec **iov, int count, size_t written)
+{
+    while (count > 0 && written >= (*iov)->iov_len)
+    {
+        written -= (*iov)->iov_len;
+        (*iov)++;
+        count--;
+    }
+    if (count > 0)
+    {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + written;
+        (*iov)->iov_len -= written;
+    }
+    return count;
+}
+
+// Function to write a batch with sendmsg, resuming after partial writes
+static int send_batch_plain(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = count > SENDMSG_MAX_IOV ? SENDMSG_MAX_IOV : count;
+
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        count = skip_written(&iov, count, sent);
+    }
+    return 1;
+}
+
+// Function to write a batch of buffers to a socket with as few syscalls as possible
+// With io_uring the batch goes out as a chain of linked sendmsg entries straight from the caller's buffers. Every
+// entry waits for all of its bytes (MSG_WAITALL), so a short one fails the link and the kernel cancels the rest
+// of the chain; the batch then resumes from exactly the bytes the completed entries wrote
+int io_send_batch(IoSender *sender, int fd, struct iovec *iov, int count)
+{
+    while (count > 0 && sender->uring)
+    {
+        size_t wanted[URING_SEND_ENTRIES];
+        int results[URING_SEND_ENTRIES];
+        int queued = 0;
+        int next = 0;
+        struct io_uring_sqe *sqe, *last = NULL;
+        while (next < count && queued < URING_SEND_ENTRIES && (sqe = ring_get_sqe(&sender->ring)) != NULL)
+        {
+            struct msghdr *message = &sender->messages[queued];
+            memset(message, 0, sizeof(*message));
+            message->msg_iov = &iov[next];
+            message->msg_iovlen = count - next > SENDMSG_MAX_IOV ? SENDMSG_MAX_IOV : count - next;
+            wanted[queued] = 0;
+            for (size_t i = 0; i < message->msg_iovlen; i++)
+            {
+                wanted[queued] += iov[next + i].iov_len;
+            }
+            next += message->msg_iovlen;
+
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long)message;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = queued;
+            last = sqe;
+            queued++;
+        }
+        if (last == NULL)
+        {
+            break;
+        }
+        last->flags = 0; // The chain ends with this submission
+
+        // Collect every completion before touching the buffers again, the kernel may still be reading them
+        for (int pending = queued; pending > 0;)
+        {
+            struct io_uring_cqe cqe;
+            if (!ring_pop_cqe(&sender->ring, &cqe))
+            {
+                if (ring_enter(&sender->ring, 1, NULL) == -1 && errno != EINTR)
+                {
+                    return 0;
+                }
+                continue;
+            }
+            results[cqe.user_data] = cqe.res;
+            pending--;
+        }
+
+        // Count the bytes written up to the first entry that stopped short; nothing after it was sent
+        size_t written = 0;
+        int entry = 0;
+        while (entry < queued && results[entry] >= 0 && (size_t)results[entry] == wanted[entry])
+        {
+            written += results[entry++];
+        }
+        if (entry == queued)
+        {
+            count = skip_written(&iov, count, written);
+            continue;
+        }
+
+        int result = results[entry];
+        if (result == -EINVAL)
+        {
+            sender->uring = 0; // The kernel can't send this way, this sender uses sendmsg from now on
+        }
+        else if (result < 0 && result != -EINTR && result != -EAGAIN)
+        {
+            return 0; // The socket failed (the peer left)
+        }
+        else if (result > 0)
+        {
+            written += result;
+        }
+
+        // Whatever the kernel did not write is sent the plain way
+        count = skip_written(&iov, count, written);
+        break;
+    }
+    return send_batch_plain(fd, iov, count);
+}
@@ -0,0 +1,40 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <signal.h>
+#include <sys/uio.h>
+
+#define IO_BACKEND_EPOLL 0 // epoll for accepting, send/sendmsg for writing
+#define IO_BACKEND_URING 1 // io_uring: multishot accept, batched sends as linked sendmsg chains
+
+#define IO_MAX_LISTENERS 4
+
+typedef struct IoListener IoListener;
+typedef struct IoSender IoSender;
+
+// Function to pick the I/O backend: io_uring if allowed and the kernel supports it, epoll otherwise
+// Returns the backend in use (IO_BACKEND_*)
+int io_backend_init(int allow_uring);
+
+// Function to get the name of the backend in use, for logging
+const char *io_backend_name();
+
+// Function to start accepting connections on listening sockets
+IoListener *io_listener_create(int *listen_fds, int count);
+
+// Function to wait for the next accepted connection, with wait_mask as signal mask while blocked
+// Returns the new socket and sets *listen_fd to the socket it was accepted on
+// Returns -1 on error, with errno EINTR if a signal interrupted the wait
+int io_listener_accept(IoListener *listener, int *listen_fd, const sigset_t *wait_mask);
+
+// Function to create a sender, used by one thread to write batches of buffers to sockets
+IoSender *io_sender_create();
+
+// Function to free a sender
+void io_sender_destroy(IoSender *sender);
+
+// Function to write a batch of buffers to a socket with as few syscalls as possible
+// Returns 0 if the socket can no longer be written to
+int io_send_batch(IoSender *sender, int fd, struct iovec *iov, int count);
+
+#endif
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include "io_backend.h"
+#include "shm_transport.h"
+
+#define BENCH_CONNECTIONS 8
+#define BENCH_ARTICLES 20000      // Articles sent to each connection
+#define BENCH_ARTICLE_SIZE 600    // Roughly the size of one JSON article line
+#define BENCH_MAX_BATCH 64
+#define BENCH_ROUND_TRIPS 20000 // Articles bounced back and forth to measure latency
+
+// Data structure for one simulated subscriber connection
+typedef struct
+{
+    int send_fd;
+    int recv_fd;
+    int batch_size;
+    double seconds;
+} BenchConnection;
+
+// Function to create a connected pair of loopback TCP sockets
+int connect_pair(int *send_fd, int *recv_fd)
+{
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(server_fd, 1) < 0 ||
+        getsockname(server_fd, (struct sockaddr *)&address, &addrlen) < 0)
+    {
+        perror("Failed to listen");
+        close(server_fd);
+        return 0;
+    }
+
+    *send_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*send_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        perror("Failed to connect");
+        close(server_fd);
+        return 0;
+    }
+    *recv_fd = accept(server_fd, NULL, NULL);
+    close(server_fd);
+    return *recv_fd >= 0;
+}
+
+// Function to read and discard everything sent on a connection
+void *drain_connection(void *arg)
+{
+    BenchConnection *connection = (BenchConnection *)arg;
+    char buffer[65536];
+    long remaining = (long)BENCH_ARTICLES * BENCH_ARTICLE_SIZE;
+    while (remaining > 0)
+    {
+        ssize_t received = recv(connection->recv_fd, buffer, sizeof(buffer), 0);
+        if (received <= 0)
+        {
+            break;
+        }
+        remaining -= received;
+    }
+    return NULL;
+}
+
+// Function to send every article to a connection in batches, like a broker subscriber thread
+void *feed_connection(void *arg)
+{
+    BenchConnection *connection = (BenchConnection *)arg;
+    static char article[BENCH_ARTICLE_SIZE];
+    memset(article, 'x', sizeof(article) - 1);
+    article[sizeof(article) - 1] = '\n';
+
+    IoSender *sender = io_sender_create();
+    struct iovec iov[BENCH_MAX_BATCH];
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    for (int sent = 0; sent < BENCH_ARTICLES; sent += connection->batch_size)
+    {
+        int count = BENCH_ARTICLES - sent < connection->batch_size ? BENCH_ARTICLES - sent : connection->batch_size;
+        for (int i = 0; i < count; i++)
+        {
+            iov[i].iov_base = article;
+            iov[i].iov_len = sizeof(article);
+        }
+        if (!io_send_batch(sender, connection->send_fd, iov, count))
+        {
+            perror("Failed to send batch");
+            break;
+        }
+    }
+
+    gettimeofday(&end, NULL);
+    connection->seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    io_sender_destroy(sender);
+    return NULL;
+}
+
+// Function to run one round: every connection is fed by its own thread, as in the broker
+double run_round(int batch_size)
+{
+    BenchConnection connections[BENCH_CONNECTIONS];
+    pthread_t feeders[BENCH_CONNECTIONS], drainers[BENCH_CONNECTIONS];
+    struct timeval start, end;
+
+    for (int i = 0; i < BENCH_CONNECTIONS; i++)
+    {
+        if (!connect_pair(&connections[i].send_fd, &connections[i].recv_fd))
+        {
+            exit(1);
+        }
+        connections[i].batch_size = batch_size;
+    }
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < BENCH_CONNECTIONS; i++)
+    {
+        pthread_create(&drainers[i], NULL, drain_connection, &connections[i]);
+        pthread_create(&feeders[i], NULL, feed_connection, &connections[i]);
+    }
+    for (int i = 0; i < BENCH_CONNECTIONS; i++)
+    {
+        pthread_join(feeders[i], NULL);
+        pthread_join(drainers[i], NULL);
+        close(connections[i].send_fd);
+        close(connections[i].recv_fd);
+    }
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+// Data structure for the two directions of a latency round trip
+typedef struct
+{
+    int fds[2];          // Loopback sockets: 0 carries the article there, 1 brings it back
+    ShmRing *rings[2];   // Or shared-memory rings (both sides mapped in this process)
+} BenchEcho;
+
+// Function to receive exactly one article from a socket
+int recv_article(int fd, char *buffer)
+{
+    int received = 0;
+    while (received < BENCH_ARTICLE_SIZE)
+    {
+        ssize_t n = recv(fd, buffer + received, BENCH_ARTICLE_SIZE - received, 0);
+        if (n <= 0)
+        {
+            return 0;
+        }
+        received += n;
+    }
+    return 1;
+}
+
+// Function to send every article it receives straight back, like a subscriber answering a publisher
+void *echo_articles(void *arg)
+{
+    BenchEcho *echo = (BenchEcho *)arg;
+    char buffer[BENCH_ARTICLE_SIZE];
+    for (int i = 0; i < BENCH_ROUND_TRIPS; i++)
+    {
+        struct iovec iov;
+        if (echo->rings[0] != NULL)
+        {
+            char *line;
+            if (!shm_ring_read(echo->rings[0], &line))
+            {
+                break;
+            }
+            iov.iov_base = line;
+            iov.iov_len = BENCH_ARTICLE_SIZE;
+            line[BENCH_ARTICLE_SIZE - 1] = '\n'; // Give the terminator back its newline
+            shm_ring_write(echo->rings[1], &iov, 1);
+            shm_ring_release(echo->rings[0]);
+        }
+        else
+        {
+            if (!recv_article(echo->fds[0], buffer))
+            {
+                break;
+            }
+            send(echo->fds[1], buffer, BENCH_ARTICLE_SIZE, 0);
+        }
+    }
+    return NULL;
+}
+
+// Function to measure the one-way latency of an article (half the average round trip) in microseconds
+double measure_latency(int use_rings)
+{
+    BenchEcho echo;
+    ShmRing rings[2];
+    int peer_fds[2];
+    memset(&echo, 0, sizeof(echo));
+    if (use_rings)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (!shm_ring_create(&rings[i]))
+            {
+                exit(1);
+            }
+            echo.rings[i] = &rings[i];
+        }
+    }
+    else
+    {
+        int nodelay = 1;
+        for (int i = 0; i < 2; i++)
+        {
+            if (!connect_pair(&peer_fds[i], &echo.fds[i]))
+            {
+                exit(1);
+            }
+            setsockopt(peer_fds[i], IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            setsockopt(echo.fds[i], IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+        // The echo thread receives on one socket of the first pair and answers on the other one of the second pair
+        int answer_fd = echo.fds[1];
+        echo.fds[1] = peer_fds[1];
+        peer_fds[1] = answer_fd;
+    }
+
+    static char article[BENCH_ARTICLE_SIZE];
+    char buffer[BENCH_ARTICLE_SIZE];
+    memset(article, 'x', sizeof(article) - 1);
+    article[sizeof(article) - 1] = '\n';
+    struct iovec iov = {article, sizeof(article)};
+
+    pthread_t echo_thread;
+    pthread_create(&echo_thread, NULL, echo_articles, &echo);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < BENCH_ROUND_TRIPS; i++)
+    {
+        if (use_rings)
+        {
+            char *line;
+            shm_ring_write(&rings[0], &iov, 1);
+            if (!shm_ring_read(&rings[1], &line))
+            {
+                break;
+            }
+            shm_ring_release(&rings[1]);
+        }
+        else
+        {
+            send(peer_fds[0], article, sizeof(article), 0);
+            if (!recv_article(peer_fds[1], buffer))
+            {
+                break;
+            }
+        }
+    }
+    gettimeofday(&end, NULL);
+    pthread_join(echo_thread, NULL);
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (use_rings)
+        {
+            shm_ring_close(&rings[i]);
+        }
+        else
+        {
+            close(peer_fds[i]);
+            close(echo.fds[i]);
+        }
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    return seconds * 1e6 / BENCH_ROUND_TRIPS / 2;
+}
+
+// Main function for the I/O backend benchmark: fans articles out to loopback connections with each backend
+int main()
+{
+    int batch_sizes[] = {1, 8, 64};
+    int backends[] = {IO_BACKEND_EPOLL, IO_BACKEND_URING};
+
+    printf("%d connections x %d articles of %d bytes\n", BENCH_CONNECTIONS, BENCH_ARTICLES, BENCH_ARTICLE_SIZE);
+    printf("%-10s %6s %14s %10s\n", "backend", "batch", "articles/s", "MB/s");
+    for (int b = 0; b < 2; b++)
+    {
+        if (io_backend_init(backends[b] == IO_BACKEND_URING) != backends[b])
+        {
+            printf("%-10s not supported by this kernel\n", "io_uring");
+            continue;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            double seconds = run_round(batch_sizes[i]);
+            double articles = (double)BENCH_CONNECTIONS * BENCH_ARTICLES;
+            printf("%-10s %6d %14.0f %10.1f\n", io_backend_name(), batch_sizes[i], articles / seconds,
+                   articles * BENCH_ARTICLE_SIZE / seconds / (1024 * 1024));
+        }
+    }
+
+    // Local clients: shared-memory ring against loopback TCP
+    printf("\none-way latency of a %d byte article (%d round trips)\n", BENCH_ARTICLE_SIZE, BENCH_ROUND_TRIPS);
+    printf("%-10s %8.2f us\n", "tcp", measure_latency(0));
+    printf("%-10s %8.2f us\n", "shm", measure_latency(1));
+    return 0;
+}
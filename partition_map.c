@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "partition_map.h"
+
+#define DEFAULT_SUBSCRIBER_PORT 8080
+#define DEFAULT_PUBLISHER_PORT 8081
+
+// Function to load the partition map from a file
+// Format, one entry per line ('#' starts a comment):
+//   broker <id> <host> <subscriber_port> <publisher_port>
+//   topic <name> <broker_id>
+//   follower <leader_id> <follower_id>
+//   acks async|one|all
+int load_partition_map(const char *filename, PartitionMap *map)
+{
+    memset(map, 0, sizeof(*map));
+    for (int i = 0; i < MAX_BROKERS; i++)
+    {
+        map->leader_of[i] = -1;
+    }
+    map->ack_mode = ACK_MODE_ASYNC;
+
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        // No map: everything lives on one local broker
+        map->brokers[0].id = 0;
+        strcpy(map->brokers[0].host, "127.0.0.1");
+        map->brokers[0].subscriber_port = DEFAULT_SUBSCRIBER_PORT;
+        map->brokers[0].publisher_port = DEFAULT_PUBLISHER_PORT;
+        map->broker_count = 1;
+        return 1;
+    }
+
+    char line[256];
+    int line_no = 0;
+    int valid = 1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_no++;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        char kind[16];
+        if (sscanf(line, "%15s", kind) != 1)
+        {
+            continue; // Blank or comment line
+        }
+
+        if (strcmp(kind, "broker") == 0 && map->broker_count < MAX_BROKERS)
+        {
+            BrokerAddress *broker = &map->brokers[map->broker_count];
+            if (sscanf(line, "%*s %d %63s %d %d", &broker->id, broker->host, &broker->subscriber_port, &broker->publisher_port) == 4 &&
+                broker->id >= 0 && broker->id < MAX_BROKERS && find_broker(map, broker->id) == NULL)
+            {
+                map->broker_count++;
+                continue;
+            }
+        }
+        else if (strcmp(kind, "topic") == 0 && map->override_count < MAX_PARTITION_OVERRIDES)
+        {
+            PartitionOverride *override = &map->overrides[map->override_count];
+            if (sscanf(line, "%*s %63s %d", override->topic, &override->broker_id) == 2)
+            {
+                map->override_count++;
+                continue;
+            }
+        }
+        else if (strcmp(kind, "follower") == 0)
+        {
+            int leader_id, follower_id;
+            if (sscanf(line, "%*s %d %d", &leader_id, &follower_id) == 2 && leader_id >= 0 && leader_id < MAX_BROKERS &&
+                follower_id >= 0 && follower_id < MAX_BROKERS && leader_id != follower_id)
+            {
+                map->leader_of[follower_id] = leader_id;
+                continue;
+            }
+        }
+        else if (strcmp(kind, "priority") == 0 && map->priority_count < MAX_TOPIC_PRIORITIES)
+        {
+            TopicPriority *priority = &map->priorities[map->priority_count];
+            char name[16];
+            if (sscanf(line, "%*s %63s %15s", priority->topic, name) == 2 && (priority->priority = parse_priority(name)) >= 0)
+            {
+                map->priority_count++;
+                continue;
+            }
+        }
+        else if (strcmp(kind, "coalesce") == 0)
+        {
+            char cork[16] = "";
+            int fields = sscanf(line, "%*s %d %15s", &map->coalesce_budget_us, cork);
+            if (fields >= 1 && map->coalesce_budget_us >= 0 && (fields == 1 || strcmp(cork, "cork") == 0))
+            {
+                map->coalesce_cork = fields == 2;
+                continue;
+            }
+        }
+        else if (strcmp(kind, "acks") == 0)
+        {
+            char mode[16];
+            if (sscanf(line, "%*s %15s", mode) == 1)
+            {
+                if (strcmp(mode, "async") == 0)
+                {
+                    map->ack_mode = ACK_MODE_ASYNC;
+                    continue;
+                }
+                if (strcmp(mode, "one") == 0)
+                {
+                    map->ack_mode = ACK_MODE_ONE;
+                    continue;
+                }
+                if (strcmp(mode, "all") == 0)
+                {
+                    map->ack_mode = ACK_MODE_ALL;
+                    continue;
+                }
+            }
+        }
+
+        fprintf(stderr, "%s:%d: invalid partition map entry\n", filename, line_no);
+        valid = 0;
+    }
+    fclose(file);
+
+    int leader_count = 0;
+    for (int i = 0; i < map->broker_count; i++)
+    {
+        int id = map->brokers[i].id;
+        if (map->leader_of[id] < 0)
+        {
+            leader_count++;
+        }
+        else if (find_broker(map, map->leader_of[id]) == NULL || map->leader_of[map->leader_of[id]] >= 0)
+        {
+            fprintf(stderr, "%s: broker %d follows %d, which isn't a leader\n", filename, id, map->leader_of[id]);
+            valid = 0;
+        }
+    }
+    if (leader_count == 0)
+    {
+        fprintf(stderr, "%s: no (leader) brokers defined\n", filename);
+        return 0;
+    }
+    for (int i = 0; i < map->override_count; i++)
+    {
+        if (find_broker(map, map->overrides[i].broker_id) == NULL)
+        {
+            fprintf(stderr, "%s: topic '%s' is assigned to unknown broker %d\n", filename, map->overrides[i].topic, map->overrides[i].broker_id);
+            valid = 0;
+        }
+    }
+    return valid;
+}
+
+// Function to find a broker in the map by id, NULL if it doesn't exist
+const BrokerAddress *find_broker(const PartitionMap *map, int id)
+{
+    for (int i = 0; i < map->broker_count; i++)
+    {
+        if (map->brokers[i].id == id)
+        {
+            return &map->brokers[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to find the broker that owns a topic
+const BrokerAddress *find_topic_owner(const PartitionMap *map, const char *topic)
+{
+    for (int i = 0; i < map->override_count; i++)
+    {
+        if (strcmp(map->overrides[i].topic, topic) == 0)
+        {
+            return find_broker(map, map->overrides[i].broker_id);
+        }
+    }
+
+    // Only leaders take part in the hash partitioning
+    const BrokerAddress *leaders[MAX_BROKERS];
+    int leader_count = 0;
+    for (int i = 0; i < map->broker_count; i++)
+    {
+        if (map->leader_of[map->brokers[i].id] < 0)
+        {
+            leaders[leader_count++] = &map->brokers[i];
+        }
+    }
+
+    unsigned long hash = 5381; // djb2
+    for (const char *c = topic; *c != '\0'; c++)
+    {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    return leaders[hash % leader_count];
+}
+
+// Function to find the first follower of a broker, NULL if it has none
+const BrokerAddress *find_follower(const PartitionMap *map, int leader_id)
+{
+    for (int i = 0; i < map->broker_count; i++)
+    {
+        if (map->leader_of[map->brokers[i].id] == leader_id)
+        {
+            return &map->brokers[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to find a broker by the address subscribers connect to, NULL if it isn't in the map
+const BrokerAddress *find_broker_by_subscriber_address(const PartitionMap *map, const char *host, int port)
+{
+    for (int i = 0; i < map->broker_count; i++)
+    {
+        if (strcmp(map->brokers[i].host, host) == 0 && map->brokers[i].subscriber_port == port)
+        {
+            return &map->brokers[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to find the priority class of a topic, PRIORITY_NORMAL unless the map sets one
+int find_topic_priority(const PartitionMap *map, const char *topic)
+{
+    for (int i = 0; i < map->priority_count; i++)
+    {
+        if (strcmp(map->priorities[i].topic, topic) == 0)
+        {
+            return map->priorities[i].priority;
+        }
+    }
+    return PRIORITY_NORMAL;
+}
+
+// Function to parse the name of a priority class, -1 if it isn't one
+int parse_priority(const char *name)
+{
+    for (int i = 0; i < PRIORITY_CLASSES; i++)
+    {
+        if (strcmp(priority_name(i), name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to get the name of a priority class
+const char *priority_name(int priority)
+{
+    static const char *names[PRIORITY_CLASSES] = {"urgent", "normal", "bulk"};
+    return names[priority];
+}
+
+// Function to open a TCP connection to a broker, returns the socket or -1
+int connect_to_broker(const char *host, int port)
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == -1)
+    {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    struct sockaddr_in broker_addr;
+    broker_addr.sin_family = AF_INET;
+    broker_addr.sin_port = htons(port);
+    broker_addr.sin_addr.s_addr = inet_addr(host);
+
+    if (connect(sockfd, (struct sockaddr *)&broker_addr, sizeof(broker_addr)) < 0)
+    {
+        perror("Connection to broker failed");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
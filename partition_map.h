@@ -0,0 +1,91 @@
+#ifndef PARTITION_MAP_H
+#define PARTITION_MAP_H
+
+#define PARTITION_MAP_FILE "partitions.map"
+#define MAX_BROKERS 8
+#define MAX_PARTITION_OVERRIDES 16
+#define MAX_HOST_LENGTH 64
+#define MAX_TOPIC_NAME_LENGTH 64
+#define MAX_TOPIC_PRIORITIES 16
+
+// When an article counts as written, and may be delivered to subscribers
+#define ACK_MODE_ASYNC 0 // As soon as the leader stored it (followers may lag behind)
+#define ACK_MODE_ONE 1   // Once at least one follower stored it (semi-synchronous)
+#define ACK_MODE_ALL 2   // Once every follower stored it
+
+// Priority classes (lanes) of articles, most urgent first
+#define PRIORITY_URGENT 0 // Breaking news, delivered ahead of the other lanes
+#define PRIORITY_NORMAL 1 // Topics without a priority line
+#define PRIORITY_BULK 2   // Routine items, delivered in whatever room the other lanes leave
+#define PRIORITY_CLASSES 3
+
+// Address of one broker instance
+typedef struct
+{
+    int id;                     // Identifier of the broker (0 to MAX_BROKERS - 1), used by overrides and on the command line
+    char host[MAX_HOST_LENGTH]; // Host (IPv4 address) the broker runs on
+    int subscriber_port;        // Port on which the broker accepts subscribers
+    int publisher_port;         // Port on which the broker accepts publishers (and forwarded data)
+} BrokerAddress;
+
+// Topic pinned to a broker, overriding the hash partitioning (used to move a partition)
+typedef struct
+{
+    char topic[MAX_TOPIC_NAME_LENGTH];
+    int broker_id;
+} PartitionOverride;
+
+// Priority class of a topic's articles (an article's own "priority" field overrides it)
+typedef struct
+{
+    char topic[MAX_TOPIC_NAME_LENGTH];
+    int priority;
+} TopicPriority;
+
+// Data structure for the partition map: which broker owns which topic
+// Topics are hash-partitioned across the leader brokers unless an override pins them
+// Followers own no topics, they replicate their leader and take over if it fails
+typedef struct
+{
+    BrokerAddress brokers[MAX_BROKERS];
+    int broker_count;
+    PartitionOverride overrides[MAX_PARTITION_OVERRIDES];
+    int override_count;
+    int leader_of[MAX_BROKERS]; // Leader each broker replicates (indexed by broker id), -1 for leaders
+    int ack_mode;               // ACK_MODE_* used by leaders with followers
+    TopicPriority priorities[MAX_TOPIC_PRIORITIES];
+    int priority_count;
+    int coalesce_budget_us;     // How long a broker may hold articles back to batch them per subscriber, 0 to send right away
+    int coalesce_cork;          // Whether batches are also corked (TCP_CORK) to merge them into full TCP segments
+} PartitionMap;
+
+// Function to load the partition map from a file
+// A missing file yields a single broker on localhost with the default ports
+// Returns 0 if the file exists but is invalid
+int load_partition_map(const char *filename, PartitionMap *map);
+
+// Function to find a broker in the map by id, NULL if it doesn't exist
+const BrokerAddress *find_broker(const PartitionMap *map, int id);
+
+// Function to find the broker that owns a topic
+const BrokerAddress *find_topic_owner(const PartitionMap *map, const char *topic);
+
+// Function to find the first follower of a broker, NULL if it has none
+const BrokerAddress *find_follower(const PartitionMap *map, int leader_id);
+
+// Function to find a broker by the address subscribers connect to, NULL if it isn't in the map
+const BrokerAddress *find_broker_by_subscriber_address(const PartitionMap *map, const char *host, int port);
+
+// Function to find the priority class of a topic, PRIORITY_NORMAL unless the map sets one
+int find_topic_priority(const PartitionMap *map, const char *topic);
+
+// Function to parse the name of a priority class, -1 if it isn't one
+int parse_priority(const char *name);
+
+// Function to get the name of a priority class
+const char *priority_name(int priority);
+
+// Function to open a TCP connection to a broker, returns the socket or -1
+int connect_to_broker(const char *host, int port);
+
+#endif
@@ -5,10 +5,17 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <cjson/cJSON.h>
+#include "partition_map.h"
+#include "shm_transport.h"
+#include "article_codec.h"
 
 #define MAX_BUFFER_SIZE 20000
 #define MAX_SOURCES 100
-#define PORT_PUBLISHER 8081
+
+PartitionMap partition_map;     // Which broker owns which topic
+int broker_fds[MAX_BROKERS];    // Connection to each broker (indexed by broker id), -1 if none
+ShmRing broker_rings[MAX_BROKERS]; // Shared-memory ring to each broker on this host (indexed by broker id)
+int broker_local[MAX_BROKERS];  // Whether articles go to the broker through its ring rather than its socket
 
 // Function to read the contents of a file into a buffer
 size_t read_file_to_buffer(const char *filename, char *buffer)
@@ -42,30 +49,89 @@ size_t read_file_to_buffer(const char *filename, char *buffer)
     return bytes_read;
 }
 
-// Function to send a single article to the broker
-void publish_article(int sockfd, cJSON *article)
+// Function to send an article line to a broker, over its ring if it runs on this host
+int send_to_broker(int broker_id, char *line, size_t len)
+{
+    if (broker_local[broker_id])
+    {
+        struct iovec iov = {line, len};
+        return shm_ring_write(&broker_rings[broker_id], &iov, 1);
+    }
+    return send(broker_fds[broker_id], line, len, MSG_NOSIGNAL) != -1;
+}
+
+// Function to connect to a broker, over shared memory if it runs on this host
+// Returns the socket, or -1 if the broker can't be reached
+int connect_to_publisher_port(const BrokerAddress *broker)
+{
+    broker_local[broker->id] = 0;
+    if (shm_transport_usable(broker->host))
+    {
+        int sockfd = shm_connect(broker->id, SHM_ROLE_PUBLISH, &broker_rings[broker->id]);
+        if (sockfd >= 0)
+        {
+            printf("Connected to broker %d over shared memory\n", broker->id);
+            broker_local[broker->id] = 1;
+            return sockfd;
+        }
+    }
+    return connect_to_broker(broker->host, broker->publisher_port);
+}
+
+// Function to send a single article to the broker owning its topic
+void publish_article(const char *topic, cJSON *article)
 {
-    // Convert the JSON article object to a string
-    char *json_str = cJSON_Print(article);
+    const BrokerAddress *owner = find_topic_owner(&partition_map, topic);
+    int sockfd = broker_fds[owner->id];
+    if (sockfd < 0)
+    {
+        fprintf(stderr, "Not connected to broker %d, skipping article\n", owner->id);
+        return;
+    }
+
+    // Convert the JSON article object to a string, one article per line
+    char *json_str = cJSON_PrintUnformatted(article);
+    size_t len = strlen(json_str);
+    json_str[len] = '\n'; // Overwrite the terminator, the line is sent by length
+
+    // Or to a binary frame, if the user asked for those (NEWS_ENCODING=binary)
+    char *message = json_str;
+    size_t message_len = len + 1;
+    unsigned char *frame = article_binary_requested() ? article_encode(article, &message_len) : NULL;
+    if (frame != NULL)
+    {
+        message = (char *)frame;
+    }
 
-    // Send the article to the broker
-    if (send(sockfd, json_str, strlen(json_str), 0) == -1)
+    // Send the article to the broker, or to its follower if the broker failed
+    int sent = send_to_broker(owner->id, message, message_len);
+    const BrokerAddress *follower = find_follower(&partition_map, owner->id);
+    if (!sent && follower != NULL && broker_fds[follower->id] >= 0)
+    {
+        printf("Broker %d failed, publishing to its follower %d\n", owner->id, follower->id);
+        owner = follower;
+        sent = send_to_broker(follower->id, message, message_len);
+    }
+
+    if (!sent)
     {
         perror("Failed to send article");
     }
     else
     {
-        printf("Published Article: %s\n", json_str);
+        json_str[len] = '\0';
+        printf("Published Article to broker %d: %s\n", owner->id, json_str);
     }
 
     sleep(1);
 
     // Cleanup
     free(json_str);
+    free(frame);
 }
 
 // Function to publish articles one by one
-void publish_articles(int sockfd, cJSON *articles)
+void publish_articles(cJSON *articles)
 {
     // Filter and publish articles based on source name
     int article_count = cJSON_GetArraySize(articles);
@@ -87,7 +153,7 @@ void publish_articles(int sockfd, cJSON *articles)
                         strcmp(name->valuestring, "Reuters") == 0)
                     {
                         // Publish only if the source matches
-                        publish_article(sockfd, article);
+                        publish_article(name->valuestring, article);
                     }
                 }
             }
@@ -114,35 +180,42 @@ void process_news_json(const char *json_data)
         return;
     }
 
-    int sockfd;
-    struct sockaddr_in broker_addr;
-
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    // Connect to every broker, so each one sees the publisher finish
+    for (int i = 0; i < MAX_BROKERS; i++)
     {
-        perror("Socket creation failed");
-        return;
+        broker_fds[i] = -1;
     }
-
-    broker_addr.sin_family = AF_INET;
-    broker_addr.sin_port = htons(PORT_PUBLISHER);
-    broker_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    // Connect to the broker
-    if (connect(sockfd, (struct sockaddr *)&broker_addr, sizeof(broker_addr)) < 0)
+    for (int i = 0; i < partition_map.broker_count; i++)
     {
-        perror("Connection to broker failed");
-        return;
+        const BrokerAddress *broker = &partition_map.brokers[i];
+        broker_fds[broker->id] = connect_to_publisher_port(broker);
+        if (broker_fds[broker->id] < 0)
+        {
+            cJSON_Delete(root);
+            return;
+        }
     }
 
-    // Publish articles to the broker one by one
-    publish_articles(sockfd, articles);
+    // Publish articles to the owning brokers one by one
+    publish_articles(articles);
 
     // Cleanup
     cJSON_Delete(root);
 
-    // Close the socket
-    close(sockfd);
+    // Close the sockets
+    for (int i = 0; i < partition_map.broker_count; i++)
+    {
+        int id = partition_map.brokers[i].id;
+        if (broker_local[id])
+        {
+            shm_ring_finish(&broker_rings[id]);
+        }
+        close(broker_fds[id]);
+        if (broker_local[id])
+        {
+            shm_ring_close(&broker_rings[id]);
+        }
+    }
 }
 
 int main()
@@ -151,6 +224,12 @@ int main()
 
     const char *filename = "news_articles.json"; // Path to your JSON file
 
+    // Find out which broker owns which topic
+    if (!load_partition_map(PARTITION_MAP_FILE, &partition_map))
+    {
+        exit(1);
+    }
+
     // Read the file into the buffer
     size_t bytes_read = read_file_to_buffer(filename, buffer);
     if (bytes_read == 0)
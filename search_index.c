@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include "search_index.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "article_codec.h"
+
+#define NO_PUBLISHED_TIME LLONG_MIN // publishedAt of articles without a valid one, they sort first
+
+// Function to hash a term (FNV-1a)
+static unsigned int hash_term(const char *term)
+{
+    unsigned int hash = 2166136261u;
+    for (; *term != '\0'; term++)
+    {
+        hash = (hash ^ (unsigned char)*term) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to find the slot of a term in the term table: where it is, or the free slot it would go to
+static TermPostings *find_slot(TermPostings *terms, int slots, const char *term)
+{
+    unsigned int slot = hash_term(term) % slots;
+    while (terms[slot].term[0] != '\0' && strcmp(terms[slot].term, term) != 0)
+    {
+        slot = (slot + 1) % slots;
+    }
+    return &terms[slot];
+}
+
+// Function to double the term table, moving every term to its slot in the bigger one
+static void grow_terms(SearchIndex *index)
+{
+    int slots = index->term_slots * 2;
+    TermPostings *terms = calloc(slots, sizeof(TermPostings));
+    for (int i = 0; i < index->term_slots; i++)
+    {
+        if (index->terms[i].term[0] != '\0')
+        {
+            *find_slot(terms, slots, index->terms[i].term) = index->terms[i];
+        }
+    }
+    free(index->terms);
+    index->terms = terms;
+    index->term_slots = slots;
+}
+
+// Function to find the posting list of a term, creating it if asked to
+static TermPostings *find_postings(SearchIndex *index, const char *term, int create)
+{
+    TermPostings *postings = find_slot(index->terms, index->term_slots, term);
+    if (postings->term[0] != '\0')
+    {
+        return postings;
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+
+    // Keep a quarter of the slots free, so probing for a missing term always ends early
+    if (index->term_count + 1 > index->term_slots * 3 / 4)
+    {
+        grow_terms(index);
+        postings = find_slot(index->terms, index->term_slots, term);
+    }
+    strcpy(postings->term, term);
+    postings->last_article = -1;
+    index->term_count++;
+    return postings;
+}
+
+// Function to append an article to a posting list as the varint delta from the previous one
+static void append_posting(TermPostings *postings, int article)
+{
+    if (article <= postings->last_article)
+    {
+        return; // Already listed (the word occurs more than once)
+    }
+    if (postings->length + 5 > postings->capacity)
+    {
+        postings->capacity = postings->capacity == 0 ? 16 : postings->capacity * 2;
+        postings->postings = realloc(postings->postings, postings->capacity);
+    }
+
+    unsigned int delta = article - postings->last_article;
+    while (delta >= 0x80)
+    {
+        postings->postings[postings->length++] = (delta & 0x7F) | 0x80;
+        delta >>= 7;
+    }
+    postings->postings[postings->length++] = delta;
+    postings->last_article = article;
+}
+
+// Function to check whether a text continues with UTF-8 punctuation (U+2000 to U+203F: quotes, dashes, ellipsis)
+static int is_utf8_punctuation(const char *c)
+{
+    return (unsigned char)c[0] == 0xE2 && (unsigned char)c[1] == 0x80 && c[2] != '\0';
+}
+
+// Function to check whether a text continues with a byte of a word: a letter or digit, or a byte of a multi-byte
+// UTF-8 character other than punctuation
+static int is_word_byte(const char *c)
+{
+    unsigned char byte = *c;
+    return byte != '\0' && !is_utf8_punctuation(c) && (isalnum(byte) || byte >= 0x80);
+}
+
+// Function to take the next word of a text, lowercased and truncated to SEARCH_MAX_TERM_LENGTH - 1 bytes
+// Titles, descriptions and query terms are all split into words this way; returns 0 once there are no more
+static int next_word(const char **text, char *word)
+{
+    const char *c = *text;
+    while (*c != '\0' && !is_word_byte(c))
+    {
+        c += is_utf8_punctuation(c) ? 3 : 1;
+    }
+
+    int length = 0;
+    for (; is_word_byte(c); c++)
+    {
+        if (length < SEARCH_MAX_TERM_LENGTH - 1)
+        {
+            word[length++] = tolower((unsigned char)*c);
+        }
+    }
+    word[length] = '\0';
+    *text = c;
+    return length > 0;
+}
+
+// Function to add every word of a text to the term index
+static void index_text(SearchIndex *index, int article, const char *text)
+{
+    char word[SEARCH_MAX_TERM_LENGTH];
+    while (next_word(&text, word))
+    {
+        append_posting(find_postings(index, word, 1), article);
+    }
+}
+
+// Function to check whether a query term holds a word that can be searched for (a letter or digit)
+int search_term_valid(const char *term)
+{
+    char word[SEARCH_MAX_TERM_LENGTH];
+    return next_word(&term, word);
+}
+
+// Function to find the first position in the time index published at or after the given time
+static int lower_bound(SearchIndex *index, long long time)
+{
+    int low = 0, high = index->count;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (index->published[index->by_time[middle]] < time)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Function to initialize an empty search index for a topic holding up to capacity articles
+void search_index_init(SearchIndex *index, int capacity)
+{
+    // Publishing must not starve behind a steady stream of queries
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&index->lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
+    index->capacity = capacity;
+    index->published = calloc(capacity, sizeof(long long));
+    index->by_time = calloc(capacity, sizeof(int));
+    index->count = 0;
+    index->terms = calloc(SEARCH_INITIAL_TERMS, sizeof(TermPostings));
+    index->term_slots = SEARCH_INITIAL_TERMS;
+    index->term_count = 0;
+}
+
+// Function to empty the index, once the topic's stored articles were dropped
+void search_index_reset(SearchIndex *index)
+{
+    pthread_rwlock_wrlock(&index->lock);
+    index->count = 0;
+    for (int i = 0; i < index->term_slots; i++)
+    {
+        free(index->terms[i].postings);
+    }
+    memset(index->terms, 0, index->term_slots * sizeof(TermPostings));
+    index->term_count = 0;
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Function to add a stored article to the index, article being its index in the topic
+void search_index_add(SearchIndex *index, int article, const cJSON *data)
+{
+    cJSON *published_at = cJSON_GetObjectItem(data, "publishedAt");
+    cJSON *title = cJSON_GetObjectItem(data, "title");
+    cJSON *description = cJSON_GetObjectItem(data, "description");
+    long long published;
+    if (!cJSON_IsString(published_at) || !article_parse_timestamp(published_at->valuestring, &published))
+    {
+        published = NO_PUBLISHED_TIME;
+    }
+
+    // Articles come in the order they were stored; one stored before the index was reset is stale
+    pthread_rwlock_wrlock(&index->lock);
+    if (article != index->count || index->count >= index->capacity)
+    {
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+
+    // Insert into the time index after the articles published at the same time, so those keep their order
+    index->published[article] = published;
+    int position = lower_bound(index, published == LLONG_MAX ? published : published + 1);
+    memmove(&index->by_time[position + 1], &index->by_time[position], (index->count - position) * sizeof(int));
+    index->by_time[position] = article;
+    index->count++;
+
+    if (cJSON_IsString(title))
+    {
+        index_text(index, article, title->valuestring);
+    }
+    if (cJSON_IsString(description))
+    {
+        index_text(index, article, description->valuestring);
+    }
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Function to find the articles published between from and to (inclusive, in seconds) mentioning every term
+int search_index_query(SearchIndex *index, long long from, long long to, char **terms, int term_count, int visible_count, int *results)
+{
+    int result_count = 0;
+    int *matches = NULL; // No of the query's words each article mentions
+    int word_count = 0;
+    int unknown_word = 0;
+
+    pthread_rwlock_rdlock(&index->lock);
+    if (term_count > 0)
+    {
+        matches = calloc(index->capacity, sizeof(int));
+    }
+
+    // A term is split into words like the indexed text ("covid-19" is "covid" and "19"), all of which must match
+    for (int t = 0; t < term_count && !unknown_word; t++)
+    {
+        const char *text = terms[t];
+        char word[SEARCH_MAX_TERM_LENGTH];
+        while (!unknown_word && next_word(&text, word))
+        {
+            TermPostings *postings = find_postings(index, word, 0);
+            if (postings == NULL)
+            {
+                unknown_word = 1; // No article mentions it
+                break;
+            }
+
+            // Decode the deltas; only articles that matched every earlier word can still match
+            int article = -1;
+            unsigned int delta = 0;
+            int shift = 0;
+            for (int i = 0; i < postings->length; i++)
+            {
+                delta |= (unsigned int)(postings->postings[i] & 0x7F) << shift;
+                shift += 7;
+                if (!(postings->postings[i] & 0x80))
+                {
+                    article += delta;
+                    if (matches[article] == word_count)
+                    {
+                        matches[article]++;
+                    }
+                    delta = 0;
+                    shift = 0;
+                }
+            }
+            word_count++;
+        }
+    }
+
+    // Walk the time range, keeping the visible articles that mention every term
+    for (int position = lower_bound(index, from); !unknown_word && position < index->count; position++)
+    {
+        int article = index->by_time[position];
+        if (index->published[article] > to)
+        {
+            break;
+        }
+        if (article < visible_count && (matches == NULL || matches[article] == word_count))
+        {
+            results[result_count++] = article;
+        }
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+    free(matches);
+    return result_count;
+}
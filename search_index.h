@@ -0,0 +1,55 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <pthread.h>
+#include <cjson/cJSON.h>
+
+#define SEARCH_INITIAL_TERMS 4096   // Slots of a topic's term table at first, it doubles whenever it gets 3/4 full
+#define SEARCH_MAX_TERM_LENGTH 32   // Longer words are indexed by their first SEARCH_MAX_TERM_LENGTH - 1 bytes
+#define SEARCH_MAX_QUERY_TERMS 8    // Queries with more terms are rejected
+
+// Posting list of one term: the articles mentioning it
+typedef struct
+{
+    char term[SEARCH_MAX_TERM_LENGTH]; // Empty for a free slot
+    unsigned char *postings;           // Article indexes in increasing order, as varint deltas
+    int length;                        // Bytes used in postings
+    int capacity;
+    int last_article;                  // Last article index appended (the base of the next delta)
+} TermPostings;
+
+// Data structure for the search index of a topic: a time index on "publishedAt" and an inverted term index
+// over "title" and "description". Queries only hold the read lock while collecting matches, and the lock prefers
+// writers, so queries never hold up publishing for more than that
+typedef struct
+{
+    pthread_rwlock_t lock;
+    int capacity;        // No of articles the topic can hold
+    long long *published; // publishedAt of each article, in seconds (indexed by article index)
+    int *by_time;        // Indexed articles sorted by publishedAt (articles without one sort first)
+    int count;           // No of indexed articles
+    TermPostings *terms; // Open-addressing hash table of term_slots slots
+    int term_slots;
+    int term_count;
+} SearchIndex;
+
+// Function to initialize an empty search index for a topic holding up to capacity articles
+void search_index_init(SearchIndex *index, int capacity);
+
+// Function to empty the index, once the topic's stored articles were dropped
+void search_index_reset(SearchIndex *index);
+
+// Function to add a stored article to the index, article being its index in the topic
+// Articles must be added in the order they were stored, others are ignored
+void search_index_add(SearchIndex *index, int article, const cJSON *data);
+
+// Function to find the articles published between from and to (inclusive, in seconds) mentioning every term
+// Terms are split into words like titles and descriptions are, an article must mention every word
+// Only articles below visible_count are considered; results are sorted by publishedAt
+// Returns the no of matching article indexes written to results (which must hold the index capacity)
+int search_index_query(SearchIndex *index, long long from, long long to, char **terms, int term_count, int visible_count, int *results);
+
+// Function to check whether a query term holds a word that can be searched for (a letter or digit)
+int search_term_valid(const char *term);
+
+#endif
@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include "shm_transport.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_HEADER_SIZE 4096     // The header gets a page of its own, the records start page-aligned
+#define SHM_WRAP_MARKER 0xFFFFFFFF // Record length meaning "the next record starts at the beginning of the ring"
+#define SHM_WAIT_TIMEOUT_MS 100  // Bound on a doorbell wait, after which the ring is checked again
+
+// Function to round a record size up to the record alignment
+static uint64_t record_size(size_t payload_length)
+{
+    return (4 + payload_length + 7) & ~(uint64_t)7;
+}
+
+// Function to get a monotonic time in microseconds
+static long long monotonic_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Function to get how long a waiting side polls the ring before sleeping on a doorbell
+// Polling only pays off while the other side runs on another CPU, on a single one it just delays it
+static long long spin_budget_us()
+{
+    static long long budget = -1;
+    if (budget < 0)
+    {
+        budget = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_US : 0;
+    }
+    return budget;
+}
+
+// Function to wake the other side sleeping on a doorbell
+static void ring_doorbell(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0)
+    {
+        perror("Failed to ring doorbell");
+    }
+}
+
+// Function to sleep on a doorbell until it rings, the peer hangs up, or the wait times out
+// Returns 0 if the peer hung up
+static int wait_on_doorbell(ShmRing *ring, int doorbell_fd)
+{
+    struct pollfd fds[2];
+    fds[0].fd = doorbell_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = ring->peer_fd;
+    fds[1].events = 0; // Only hang-ups, the socket's data belongs to the caller
+    if (poll(fds, ring->peer_fd >= 0 ? 2 : 1, SHM_WAIT_TIMEOUT_MS) > 0)
+    {
+        if (fds[0].revents & POLLIN)
+        {
+            uint64_t count;
+            if (read(doorbell_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            {
+                perror("Failed to read doorbell");
+            }
+        }
+        if (ring->peer_fd >= 0 && (fds[1].revents & (POLLHUP | POLLERR)))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to map a ring's shared memory
+static int map_ring(ShmRing *ring)
+{
+    char *base = mmap(NULL, SHM_HEADER_SIZE + SHM_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memory_fd, 0);
+    if (base == MAP_FAILED)
+    {
+        perror("Failed to map ring");
+        return 0;
+    }
+    ring->header = (ShmRingHeader *)base;
+    ring->data = base + SHM_HEADER_SIZE;
+    ring->read_length = 0;
+    return 1;
+}
+
+// Function to create a ring (the broker does, and hands it to the client in the handshake)
+int shm_ring_create(ShmRing *ring)
+{
+    ring->peer_fd = -1;
+    ring->memory_fd = memfd_create("news-ring", MFD_CLOEXEC);
+    if (ring->memory_fd < 0 || ftruncate(ring->memory_fd, SHM_HEADER_SIZE + SHM_RING_SIZE) < 0)
+    {
+        perror("Failed to create ring memory");
+        if (ring->memory_fd >= 0)
+        {
+            close(ring->memory_fd);
+        }
+        return 0;
+    }
+
+    ring->data_fd = eventfd(0, EFD_CLOEXEC);
+    ring->space_fd = eventfd(0, EFD_CLOEXEC);
+    if (ring->data_fd < 0 || ring->space_fd < 0)
+    {
+        perror("Failed to create ring doorbells");
+    }
+    if (ring->data_fd < 0 || ring->space_fd < 0 || !map_ring(ring))
+    {
+        close(ring->memory_fd);
+        if (ring->data_fd >= 0)
+        {
+            close(ring->data_fd);
+        }
+        if (ring->space_fd >= 0)
+        {
+            close(ring->space_fd);
+        }
+        return 0;
+    }
+    memset(ring->header, 0, sizeof(ShmRingHeader));
+    return 1;
+}
+
+// Function to unmap a ring and close its descriptors
+void shm_ring_close(ShmRing *ring)
+{
+    munmap(ring->header, SHM_HEADER_SIZE + SHM_RING_SIZE);
+    close(ring->memory_fd);
+    close(ring->data_fd);
+    close(ring->space_fd);
+}
+
+// Function to make written records visible to the reader, waking it if it sleeps
+static void publish_head(ShmRing *ring, uint64_t head)
+{
+    __atomic_store_n(&ring->header->head, head, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->header->reader_waiting, __ATOMIC_RELAXED))
+    {
+        ring_doorbell(ring->data_fd);
+    }
+}
+
+// Function to wait until the ring has room for the given no of bytes past head
+// Returns 0 if the reader hung up
+static int wait_for_space(ShmRing *ring, uint64_t head, uint64_t needed)
+{
+    ShmRingHeader *header = ring->header;
+    long long spin_until = 0;
+
+    while (head + needed - __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE) > SHM_RING_SIZE)
+    {
+        // Let the reader drain what was written so far
+        publish_head(ring, head);
+
+        if (spin_until == 0)
+        {
+            spin_until = monotonic_us() + spin_budget_us();
+        }
+        if (monotonic_us() < spin_until)
+        {
+            continue;
+        }
+
+        __atomic_store_n(&header->writer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (head + needed - __atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) > SHM_RING_SIZE && !wait_on_doorbell(ring, ring->space_fd))
+        {
+            __atomic_store_n(&header->writer_waiting, 0, __ATOMIC_RELAXED);
+            return 0;
+        }
+        __atomic_store_n(&header->writer_waiting, 0, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+// Function to write buffers to the ring as one record each, ringing the doorbell at most once
+int shm_ring_write(ShmRing *ring, const struct iovec *iov, int count)
+{
+    ShmRingHeader *header = ring->header;
+    uint64_t head = header->head; // Only the writer moves it
+
+    // A ring whose reader went away takes no more records, so the writer notices like it would on a socket
+    struct pollfd peer = {ring->peer_fd, 0, 0};
+    if (ring->peer_fd >= 0 && poll(&peer, 1, 0) > 0 && (peer.revents & (POLLHUP | POLLERR)))
+    {
+        errno = EPIPE;
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t size = record_size(iov[i].iov_len);
+        if (size > SHM_RING_SIZE / 2)
+        {
+            fprintf(stderr, "Record too large for the ring, dropping it\n");
+            continue;
+        }
+
+        // Records are contiguous, one that doesn't fit before the end of the ring starts over at the beginning
+        uint64_t offset = head % SHM_RING_SIZE;
+        uint64_t skip = offset + size > SHM_RING_SIZE ? SHM_RING_SIZE - offset : 0;
+        if (!wait_for_space(ring, head, skip + size))
+        {
+            errno = EPIPE;
+            return 0;
+        }
+        if (skip > 0)
+        {
+            *(uint32_t *)(ring->data + offset) = SHM_WRAP_MARKER;
+            head += skip;
+            offset = 0;
+        }
+
+        *(uint32_t *)(ring->data + offset) = iov[i].iov_len;
+        memcpy(ring->data + offset + 4, iov[i].iov_base, iov[i].iov_len);
+        head += size;
+    }
+
+    publish_head(ring, head);
+    return 1;
+}
+
+// Function to tell the reader no more records will be written
+void shm_ring_finish(ShmRing *ring)
+{
+    __atomic_store_n(&ring->header->finished, 1, __ATOMIC_RELEASE);
+    ring_doorbell(ring->data_fd);
+}
+
+// Function to wait for the next record and get it in place, newline replaced by a terminator
+int shm_ring_read(ShmRing *ring, char **line)
+{
+    ShmRingHeader *header = ring->header;
+    long long spin_until = 0;
+
+    while (1)
+    {
+        uint64_t tail = header->tail; // Only the reader moves it
+        if (__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) != tail)
+        {
+            // The writer is another process: read the length once and check it before trusting it
+            uint64_t offset = tail % SHM_RING_SIZE;
+            uint32_t length = offset % 8 == 0 ? __atomic_load_n((uint32_t *)(ring->data + offset), __ATOMIC_RELAXED) : 0;
+            if (offset % 8 == 0 && length == SHM_WRAP_MARKER)
+            {
+                __atomic_store_n(&header->tail, tail + SHM_RING_SIZE - offset, __ATOMIC_RELEASE);
+                continue;
+            }
+            if (length == 0 || length > SHM_RING_SIZE - 4 || offset + record_size(length) > SHM_RING_SIZE)
+            {
+                fprintf(stderr, "Corrupt record in shared-memory ring, closing it\n");
+                return -1;
+            }
+
+            // The reader owns the record until it releases it, so the newline can be overwritten in place
+            // Binary records (starting with a NUL byte) are left as they are, lines must end with a newline
+            *line = ring->data + offset + 4;
+            if ((*line)[0] != '\0')
+            {
+                if ((*line)[length - 1] != '\n')
+                {
+                    fprintf(stderr, "Unterminated line in shared-memory ring, closing it\n");
+                    return -1;
+                }
+                (*line)[length - 1] = '\0';
+            }
+            ring->read_length = record_size(length);
+            return length;
+        }
+
+        // Finishing happens after the last record was published, so an empty finished ring is done
+        if (__atomic_load_n(&header->finished, __ATOMIC_ACQUIRE) && __atomic_load_n(&header->head, __ATOMIC_ACQUIRE) == tail)
+        {
+            return 0;
+        }
+
+        // Poll briefly (the writer is often about to publish), then sleep on the doorbell
+        if (spin_until == 0)
+        {
+            spin_until = monotonic_us() + spin_budget_us();
+        }
+        if (monotonic_us() < spin_until)
+        {
+            continue;
+        }
+
+        __atomic_store_n(&header->reader_waiting, 1, __ATOMIC_SEQ_CST);
+        int alive = 1;
+        if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == tail && !__atomic_load_n(&header->finished, __ATOMIC_SEQ_CST))
+        {
+            alive = wait_on_doorbell(ring, ring->data_fd);
+        }
+        __atomic_store_n(&header->reader_waiting, 0, __ATOMIC_RELAXED);
+        if (!alive && __atomic_load_n(&header->head, __ATOMIC_ACQUIRE) == tail)
+        {
+            return 0;
+        }
+    }
+}
+
+// Function to hand the record got from shm_ring_read back to the writer
+void shm_ring_release(ShmRing *ring)
+{
+    ShmRingHeader *header = ring->header;
+    __atomic_store_n(&header->tail, header->tail + ring->read_length, __ATOMIC_RELEASE);
+    ring->read_length = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->writer_waiting, __ATOMIC_RELAXED))
+    {
+        ring_doorbell(ring->space_fd);
+    }
+}
+
+// Function to check whether a broker at the given host may be reached over shared memory
+int shm_transport_usable(const char *host)
+{
+    const char *transport = getenv("NEWS_TRANSPORT");
+    if (transport != NULL && strcmp(transport, "tcp") == 0)
+    {
+        return 0;
+    }
+    return strcmp(host, "127.0.0.1") == 0 || strcmp(host, "localhost") == 0;
+}
+
+// Function to fill in the address of a broker's Unix domain socket
+static void socket_address(int broker_id, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    snprintf(address->sun_path, sizeof(address->sun_path), SHM_SOCKET_FORMAT, broker_id);
+}
+
+// Function to listen for local clients of a broker, returns the socket or -1
+int shm_listen(int broker_id)
+{
+    struct sockaddr_un address;
+    socket_address(broker_id, &address);
+    unlink(address.sun_path); // Left over by a previous run
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0 || bind(sockfd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(sockfd, 16) < 0)
+    {
+        perror("Local socket failed");
+        if (sockfd >= 0)
+        {
+            close(sockfd);
+        }
+        return -1;
+    }
+    return sockfd;
+}
+
+// Function to answer a local client's handshake: reads its role line and sends it a new ring
+int shm_accept(int client_fd, ShmRing *ring, char *role, size_t role_size)
+{
+    // The client waits for the ring before sending anything else, so the role line arrives alone
+    ssize_t received = recv(client_fd, role, role_size - 1, 0);
+    if (received <= 0)
+    {
+        return 0;
+    }
+    role[received] = '\0';
+    role[strcspn(role, "\r\n")] = '\0';
+
+    if (!shm_ring_create(ring))
+    {
+        return 0;
+    }
+    ring->peer_fd = client_fd;
+
+    // Hand the memory and both doorbells over with the reply
+    int fds[3] = {ring->memory_fd, ring->data_fd, ring->space_fd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec reply = {"OK\n", 3};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &reply;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(client_fd, &message, MSG_NOSIGNAL) < 0)
+    {
+        perror("Failed to hand ring to local client");
+        shm_ring_close(ring);
+        return 0;
+    }
+    return 1;
+}
+
+// Function to connect to a broker running on this host over shared memory
+int shm_connect(int broker_id, const char *role, ShmRing *ring)
+{
+    struct sockaddr_un address;
+    socket_address(broker_id, &address);
+    if (access(address.sun_path, F_OK) != 0)
+    {
+        return -1; // No local broker with that id
+    }
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0 || connect(sockfd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        if (sockfd >= 0)
+        {
+            close(sockfd);
+        }
+        return -1;
+    }
+
+    char line[32];
+    int len = snprintf(line, sizeof(line), "%s\n", role);
+    if (send(sockfd, line, len, MSG_NOSIGNAL) != len)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    // Receive the ring: its memory and both doorbells
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    char reply[4];
+    struct iovec reply_iov = {reply, sizeof(reply) - 1};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &reply_iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg;
+    if (recvmsg(sockfd, &message, MSG_CMSG_CLOEXEC) <= 0 || (cmsg = CMSG_FIRSTHDR(&message)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    {
+        fprintf(stderr, "Local handshake with broker %d failed\n", broker_id);
+        close(sockfd);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    ring->memory_fd = fds[0];
+    ring->data_fd = fds[1];
+    ring->space_fd = fds[2];
+    ring->peer_fd = sockfd;
+    if (!map_ring(ring))
+    {
+        close(fds[0]);
+        close(fds[1]);
+        close(fds[2]);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
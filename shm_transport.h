@@ -0,0 +1,75 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define SHM_SOCKET_FORMAT "/tmp/news-broker-%d.sock" // Unix domain socket a broker accepts local clients on
+#define SHM_RING_SIZE (1 << 20)                      // Bytes of records one ring holds
+#define SHM_SPIN_US 50                               // How long a waiting side polls the ring before sleeping on a doorbell
+#define SHM_ROLE_PUBLISH "PUBLISH"                   // Handshake line of a local publisher
+#define SHM_ROLE_SUBSCRIBE "SUBSCRIBE"               // Handshake line of a local subscriber
+
+// Header of a ring, shared by its writer and its reader
+typedef struct
+{
+    uint64_t head;           // Bytes written so far (only the writer moves it)
+    uint64_t tail;           // Bytes released by the reader so far (only the reader moves it)
+    uint32_t reader_waiting; // Whether the reader sleeps on the data doorbell
+    uint32_t writer_waiting; // Whether the writer sleeps on the space doorbell
+    uint32_t finished;       // Set by the writer once it won't write anymore
+} ShmRingHeader;
+
+// Data structure for a local connection: a ring of records in shared memory, written by one side and read by the other
+// The broker creates it; each record is a 4-byte length and the payload (a newline-terminated line or a binary frame),
+// 8-byte aligned
+typedef struct
+{
+    ShmRingHeader *header;
+    char *data;           // SHM_RING_SIZE bytes of records
+    int memory_fd;        // memfd holding the header and the records
+    int data_fd;          // eventfd rung by the writer when the ring gets records
+    int space_fd;         // eventfd rung by the reader when the ring gets room
+    int peer_fd;          // Unix domain socket to the other side, its hang-up ends any wait
+    uint64_t read_length; // Size of the record the reader holds, until it releases it
+} ShmRing;
+
+// Function to create a ring (the broker does, and hands it to the client in the handshake)
+// Returns 0 on failure
+int shm_ring_create(ShmRing *ring);
+
+// Function to unmap a ring and close its descriptors
+void shm_ring_close(ShmRing *ring);
+
+// Function to write buffers to the ring as one record each, ringing the doorbell at most once
+// Blocks while the ring is full; returns 0 if the reader hung up
+int shm_ring_write(ShmRing *ring, const struct iovec *iov, int count);
+
+// Function to tell the reader no more records will be written
+void shm_ring_finish(ShmRing *ring);
+
+// Function to wait for the next record and get it in place, newline replaced by a terminator (unless it is binary)
+// The record stays valid until shm_ring_release; returns its length, 0 once the writer finished or hung up,
+// or -1 if the ring is corrupt (a record that doesn't fit the ring, a line without its newline): close it then
+int shm_ring_read(ShmRing *ring, char **line);
+
+// Function to hand the record got from shm_ring_read back to the writer
+void shm_ring_release(ShmRing *ring);
+
+// Function to check whether a broker at the given host may be reached over shared memory
+// Only brokers on this host can, and NEWS_TRANSPORT=tcp turns the shared-memory transport off
+int shm_transport_usable(const char *host);
+
+// Function to listen for local clients of a broker, returns the socket or -1
+int shm_listen(int broker_id);
+
+// Function to answer a local client's handshake: reads its role line and sends it a new ring
+// Returns 0 if the handshake failed
+int shm_accept(int client_fd, ShmRing *ring, char *role, size_t role_size);
+
+// Function to connect to a broker running on this host over shared memory
+// Returns the Unix domain socket (for acks and hang-up detection), or -1 if the broker isn't reachable that way
+int shm_connect(int broker_id, const char *role, ShmRing *ring);
+
+#endif
@@ -6,20 +6,42 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <cjson/cJSON.h>
+#include "partition_map.h"
+#include "shm_transport.h"
+#include "article_codec.h"
 
 #define MAX_TOPICS 10
 #define MAX_BUFFER_SIZE 8192
-#define PORT_SUBSCRIBER 8080
-#define NO_OF_SUBSCRIBERS 3
+#define NO_OF_SUBSCRIBERS 5
+#define ACK_BATCH_SIZE 4 // No of articles processed before acknowledging them to the broker
+#define MAX_REDIRECTS 3  // No of times a topic may be redirected, brokers with stale maps could loop otherwise
+#define FAILOVER_DELAY 1 // Seconds to give a follower to take over from its failed leader before connecting to it
 
-// Data structure for a subscriber
-typedef struct
+// Data structure for a subscriber (one per broker connection)
+typedef struct Subscriber
 {
     int sockfd;
+    char host[MAX_HOST_LENGTH]; // Broker serving the topics of this connection
+    int port;
+    char *name;  // Durable subscription name, the broker resumes after the last acked article
+    char *group; // Consumer group ("<group>[/<strategy>]"), articles are shared with the other members
     char *topics[MAX_TOPICS];
     int topic_count;
+    int last_seq[MAX_TOPICS];  // Highest sequence number processed per topic
+    int acked_seq[MAX_TOPICS]; // Highest sequence number acknowledged per topic
+    int unacked;               // No of articles processed since the last ack
+    int group_ack_topic[ACK_BATCH_SIZE]; // Group articles processed since the last ack (topic index and seq each),
+    int group_ack_seq[ACK_BATCH_SIZE];   // group members ack every article rather than a high-water mark
+    int group_ack_count;
+    struct Subscriber *redirects[MAX_TOPICS]; // Connections opened for topics the broker redirected elsewhere
+    pthread_t redirect_threads[MAX_TOPICS];
+    int redirect_count;
+    int redirect_depth; // No of redirects followed to reach this connection
+    int ended;          // Whether the broker ended the stream cleanly ("END"), rather than failing
 } Subscriber;
 
+PartitionMap partition_map; // Which broker owns which topic
+
 // Function to handle incoming data (news articles) from the broker
 void handle_received_data(int sockfd)
 {
@@ -91,59 +113,351 @@ void handle_received_data(int sockfd)
 //     printf("Sent subscription request: %s\n", topics);
 // }
 
-// Function to handle the subscriber's connection
-void *handle_subscriber(void *arg)
+// Function to acknowledge every processed article that hasn't been acked yet (one line per topic)
+void send_acks(Subscriber *subscriber)
 {
-    Subscriber *subscriber = (Subscriber *)arg;
-    char buffer[1024];
+    char acks[(MAX_TOPICS + ACK_BATCH_SIZE) * 64];
+    int len = 0;
+
+    for (int i = 0; i < subscriber->group_ack_count; i++)
+    {
+        len += snprintf(acks + len, sizeof(acks) - len, "ACK %s %d\n", subscriber->topics[subscriber->group_ack_topic[i]],
+                        subscriber->group_ack_seq[i]);
+    }
+    subscriber->group_ack_count = 0;
+
+    for (int i = 0; i < subscriber->topic_count; i++)
+    {
+        if (subscriber->group == NULL && subscriber->last_seq[i] > subscriber->acked_seq[i])
+        {
+            len += snprintf(acks + len, sizeof(acks) - len, "ACK %s %d\n", subscriber->topics[i], subscriber->last_seq[i]);
+            subscriber->acked_seq[i] = subscriber->last_seq[i];
+        }
+    }
+
+    if (len > 0 && send(subscriber->sockfd, acks, len, MSG_NOSIGNAL) < 0)
+    {
+        perror("Failed to send acks");
+    }
+    subscriber->unacked = 0;
+}
+
+// Function to process one article received from the broker (parsed from its JSON line or decoded from its binary frame)
+void process_article(Subscriber *subscriber, cJSON *root)
+{
+    cJSON *source = cJSON_GetObjectItem(root, "source");
+    cJSON *name = source != NULL ? cJSON_GetObjectItem(source, "name") : NULL;
+    cJSON *seq = cJSON_GetObjectItem(root, "seq");
+    if (name != NULL)
+    {
+        printf("Data is related to topic: %s\n", name->valuestring);
+
+        // Remember the article's position so it can be acknowledged
+        for (int i = 0; i < subscriber->topic_count; i++)
+        {
+            if (seq == NULL || strcmp(subscriber->topics[i], name->valuestring) != 0)
+            {
+                continue;
+            }
+
+            // A group member can be handed articles older than ones it processed (from a member that left),
+            // so it acks each article it got
+            if (subscriber->group != NULL && subscriber->group_ack_count < ACK_BATCH_SIZE)
+            {
+                subscriber->group_ack_topic[subscriber->group_ack_count] = i;
+                subscriber->group_ack_seq[subscriber->group_ack_count++] = seq->valueint;
+                subscriber->unacked++;
+            }
+            if (seq->valueint > subscriber->last_seq[i])
+            {
+                subscriber->last_seq[i] = seq->valueint;
+                subscriber->unacked += subscriber->group == NULL;
+            }
+        }
+    }
+
+    if (subscriber->unacked >= ACK_BATCH_SIZE)
+    {
+        send_acks(subscriber);
+    }
+}
+
+// Function to create a connection for a subscriber to a broker, carrying over its name and group but no topics
+Subscriber *new_connection(Subscriber *subscriber, const char *host, int port)
+{
+    Subscriber *connection = calloc(1, sizeof(Subscriber));
+    connection->sockfd = -1;
+    strncpy(connection->host, host, MAX_HOST_LENGTH - 1);
+    connection->port = port;
+    connection->name = subscriber->name;
+    connection->group = subscriber->group;
+    return connection;
+}
+
+// Function to add a topic to a connection
+void add_topic(Subscriber *connection, char *topic)
+{
+    if (connection->topic_count < MAX_TOPICS)
+    {
+        connection->topics[connection->topic_count++] = topic;
+    }
+}
+
+void *handle_subscriber(void *arg);
+
+// Function to follow a "MOVED <topic> <host> <port>" redirect from the broker
+// The topic is consumed over a new connection to the broker that now owns it, resuming after the last article
+// processed (the new owner holds the migrated articles under the same seqs)
+void follow_redirect(Subscriber *subscriber, const char *line)
+{
+    char topic[MAX_TOPIC_NAME_LENGTH], host[MAX_HOST_LENGTH];
+    int port;
+    if (sscanf(line, "MOVED %63s %63s %d", topic, host, &port) != 3 || subscriber->redirect_count == MAX_TOPICS ||
+        subscriber->redirect_depth == MAX_REDIRECTS)
+    {
+        fprintf(stderr, "Can't follow redirect: %s\n", line);
+        return;
+    }
+
+    for (int i = 0; i < subscriber->topic_count; i++)
+    {
+        if (strcmp(subscriber->topics[i], topic) == 0)
+        {
+            printf("Topic %s moved to broker at %s:%d, following it\n", topic, host, port);
+            Subscriber *redirect = new_connection(subscriber, host, port);
+            redirect->redirect_depth = subscriber->redirect_depth + 1;
+            add_topic(redirect, subscriber->topics[i]);
+            redirect->last_seq[0] = subscriber->last_seq[i];
+            redirect->acked_seq[0] = subscriber->acked_seq[i];
+            subscriber->redirects[subscriber->redirect_count] = redirect;
+            pthread_create(&subscriber->redirect_threads[subscriber->redirect_count], NULL, handle_subscriber, (void *)redirect);
+            subscriber->redirect_count++;
+            return;
+        }
+    }
+}
+
+// Function to process one line received from the broker: a redirect, the end of the stream, or an article
+void process_line(Subscriber *subscriber, const char *line)
+{
+    if (strncmp(line, "MOVED ", 6) == 0)
+    {
+        follow_redirect(subscriber, line);
+    }
+    else if (strcmp(line, "END") == 0)
+    {
+        subscriber->ended = 1;
+    }
+    else
+    {
+        printf("Subscriber received data: %s\n", line);
+        cJSON *root = cJSON_Parse(line);
+        if (root == NULL)
+        {
+            printf("Error parsing JSON data.\n");
+            return;
+        }
+        process_article(subscriber, root);
+        cJSON_Delete(root);
+    }
+}
+
+// Function to process one binary article frame received from the broker
+// It is converted back to JSON, so the subscriber handles it exactly like a JSON line
+void process_frame(Subscriber *subscriber, const unsigned char *frame, size_t length)
+{
+    cJSON *root = article_decode(frame, length);
+    if (root == NULL)
+    {
+        printf("Error decoding binary article.\n");
+        return;
+    }
+    char *json_str = cJSON_PrintUnformatted(root);
+    printf("Subscriber received data: %s\n", json_str);
+    free(json_str);
+    process_article(subscriber, root);
+    cJSON_Delete(root);
+}
+
+// Function to connect to the subscriber's broker and consume its topics until the stream ends
+// A broker on this host is reached over shared memory, articles are then read in place from its ring
+void consume_from_broker(Subscriber *subscriber)
+{
+    char buffer[MAX_BUFFER_SIZE];
+    int buffer_len = 0;
     int bytes_received;
+    ShmRing ring;
+    int local = 0;
+
+    // Step 1: Connect to the broker and send subscription information
+    const BrokerAddress *broker = find_broker_by_subscriber_address(&partition_map, subscriber->host, subscriber->port);
+    if (broker != NULL && shm_transport_usable(subscriber->host))
+    {
+        subscriber->sockfd = shm_connect(broker->id, SHM_ROLE_SUBSCRIBE, &ring);
+        local = subscriber->sockfd >= 0;
+    }
+    if (!local)
+    {
+        subscriber->sockfd = connect_to_broker(subscriber->host, subscriber->port);
+    }
+    if (subscriber->sockfd < 0)
+    {
+        return;
+    }
+    printf("Subscriber connected to broker at %s:%d%s\n", subscriber->host, subscriber->port, local ? " (shared memory)" : "");
 
-    // Step 1: Send subscription information to the broker
-    // Start with an empty buffer
+    // Start with the consumer group or durable subscription name (if any), e.g. "name:Reuters,CNN"
+    // Users asking for binary frames (NEWS_ENCODING=binary) prefix the request with "BINARY "
     buffer[0] = '\0';
+    if (article_binary_requested())
+    {
+        strcpy(buffer, "BINARY ");
+    }
+    if (subscriber->group != NULL)
+    {
+        snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer), "@%s:", subscriber->group);
+    }
+    else if (subscriber->name != NULL)
+    {
+        snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer), "%s:", subscriber->name);
+    }
 
     // Loop through each topic and append it to the buffer
     for (int i = 0; i < subscriber->topic_count; i++)
     {
-        // If buffer isn't empty, add a comma before appending the next topic
+        // If this isn't the first topic, add a comma before appending the next topic
         if (i > 0)
         {
             strncat(buffer, ",", sizeof(buffer) - strlen(buffer) - 1); // Add a comma between topics
         }
 
-        // Append the topic name to the buffer
+        // Append the topic name to the buffer, with the last processed seq when resuming after a failover or redirect
         strncat(buffer, subscriber->topics[i], sizeof(buffer) - strlen(buffer) - 1);
+        if (subscriber->last_seq[i] > 0)
+        {
+            snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer), "@%d", subscriber->last_seq[i]);
+        }
     }
 
     printf("Subscriber subscribed to topics: %s\n", buffer);
+    strncat(buffer, "\n", sizeof(buffer) - strlen(buffer) - 1);
     if (send(subscriber->sockfd, buffer, strlen(buffer), 0) < 0)
     {
         perror("Failed to send subscription info");
-        return NULL;
+        close(subscriber->sockfd);
+        if (local)
+        {
+            shm_ring_close(&ring);
+        }
+        return;
     }
+    buffer[0] = '\0';
 
-    // Step 2: Listen for data related to subscribed topics
-    while ((bytes_received = recv(subscriber->sockfd, buffer, sizeof(buffer) - 1, 0)) > 0)
+    // Step 2: Listen for data related to subscribed topics, one JSON article per line (or per record of the ring)
+    char *line;
+    int length;
+    while (local && (length = shm_ring_read(&ring, &line)) > 0)
     {
-        buffer[bytes_received] = '\0'; // Null-terminate the received data
-        printf("Subscriber received data: %s\n", buffer);
+        if (*line == ARTICLE_FRAME_MARKER)
+        {
+            process_frame(subscriber, (unsigned char *)line, length);
+        }
+        else
+        {
+            process_line(subscriber, line);
+        }
+        shm_ring_release(&ring);
+    }
+    while (!local && (bytes_received = recv(subscriber->sockfd, buffer + buffer_len, sizeof(buffer) - buffer_len - 1, 0)) > 0)
+    {
+        buffer_len += bytes_received;
+        buffer[buffer_len] = '\0'; // Null-terminate the received data
 
-        // Process the received data based on the topic
-        // Here we assume the data is in JSON format and can be parsed accordingly
-        cJSON *root = cJSON_Parse(buffer);
-        if (root != NULL)
+        // Process every complete line or binary frame, keep a partial one for the next recv
+        line = buffer;
+        char *newline;
+        while (line < buffer + buffer_len)
         {
-            cJSON *source = cJSON_GetObjectItem(root, "source");
-            if (source != NULL)
+            if (*line == ARTICLE_FRAME_MARKER)
             {
-                cJSON *name = cJSON_GetObjectItem(source, "name");
-                if (name != NULL)
+                long frame_length = article_frame_length((unsigned char *)line, buffer + buffer_len - line);
+                if (frame_length == 0)
+                {
+                    break;
+                }
+                if (frame_length < 0)
                 {
-                    printf("Data is related to topic: %s\n", name->valuestring);
+                    fprintf(stderr, "Invalid binary frame, dropping received data\n");
+                    line = buffer + buffer_len;
+                    break;
                 }
+                process_frame(subscriber, (unsigned char *)line, frame_length);
+                line += frame_length;
+                continue;
             }
-            cJSON_Delete(root);
+
+            if ((newline = memchr(line, '\n', buffer + buffer_len - line)) == NULL)
+            {
+                break;
+            }
+            *newline = '\0';
+            process_line(subscriber, line);
+            line = newline + 1;
         }
+        buffer_len -= line - buffer;
+        memmove(buffer, line, buffer_len);
+
+        // An article that doesn't fit in the buffer can't be parsed, drop it
+        if (buffer_len == sizeof(buffer) - 1)
+        {
+            fprintf(stderr, "Article too large, dropping it\n");
+            buffer_len = 0;
+        }
+    }
+
+    // The broker ended the stream, acknowledge what's left before closing
+    send_acks(subscriber);
+    close(subscriber->sockfd);
+    if (local)
+    {
+        shm_ring_close(&ring);
+    }
+}
+
+// Function to switch a subscriber whose broker failed over to that broker's follower
+// Returns 0 if the broker has no follower
+int fail_over(Subscriber *subscriber)
+{
+    const BrokerAddress *broker = find_broker_by_subscriber_address(&partition_map, subscriber->host, subscriber->port);
+    const BrokerAddress *follower = broker != NULL ? find_follower(&partition_map, broker->id) : NULL;
+    if (follower == NULL)
+    {
+        return 0;
+    }
+
+    printf("Broker at %s:%d failed, resuming on its follower at %s:%d\n", subscriber->host, subscriber->port, follower->host, follower->subscriber_port);
+    strncpy(subscriber->host, follower->host, MAX_HOST_LENGTH - 1);
+    subscriber->port = follower->subscriber_port;
+    sleep(FAILOVER_DELAY);
+    return 1;
+}
+
+// Function to handle the subscriber's connection, following its broker's follower if the broker fails
+void *handle_subscriber(void *arg)
+{
+    Subscriber *subscriber = (Subscriber *)arg;
+
+    consume_from_broker(subscriber);
+    while (!subscriber->ended && fail_over(subscriber))
+    {
+        consume_from_broker(subscriber);
+    }
+
+    // Wait for the connections to brokers the topics moved to
+    for (int i = 0; i < subscriber->redirect_count; i++)
+    {
+        pthread_join(subscriber->redirect_threads[i], NULL);
+        free(subscriber->redirects[i]);
     }
     return NULL;
 }
@@ -151,62 +465,92 @@ void *handle_subscriber(void *arg)
 // Main function to run the subscriber
 int main()
 {
-    pthread_t subscriber_threads[NO_OF_SUBSCRIBERS];
     Subscriber *subscribers[NO_OF_SUBSCRIBERS];
+    Subscriber *connections[NO_OF_SUBSCRIBERS * MAX_TOPICS];
+    pthread_t connection_threads[NO_OF_SUBSCRIBERS * MAX_TOPICS];
+    int connection_count = 0;
+
+    // Find out which broker owns which topic
+    if (!load_partition_map(PARTITION_MAP_FILE, &partition_map))
+    {
+        return -1;
+    }
 
     // Subscriber 1 subscribes to Reuters and CNN
-    subscribers[0] = malloc(sizeof(Subscriber));
-    subscribers[0]->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    subscribers[0] = calloc(1, sizeof(Subscriber));
+    subscribers[0]->name = "subscriber-1";
     subscribers[0]->topic_count = 2;
     subscribers[0]->topics[0] = "Reuters";
     subscribers[0]->topics[1] = "CNN";
 
     // Subscriber 2 subscribes to BBC, Reuters, and CNN
-    subscribers[1] = malloc(sizeof(Subscriber));
-    subscribers[1]->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    subscribers[1] = calloc(1, sizeof(Subscriber));
+    subscribers[1]->name = "subscriber-2";
     subscribers[1]->topic_count = 3;
     subscribers[1]->topics[0] = "BBC";
     subscribers[1]->topics[1] = "Reuters";
     subscribers[1]->topics[2] = "CNN";
 
     // Subscriber 3 subscribes only to Reuters
-    subscribers[2] = malloc(sizeof(Subscriber));
-    subscribers[2]->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    subscribers[2] = calloc(1, sizeof(Subscriber));
+    subscribers[2]->name = "subscriber-3";
     subscribers[2]->topic_count = 1;
     subscribers[2]->topics[0] = "Reuters";
 
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(PORT_SUBSCRIBER); // Broker's listening port
-    server_address.sin_addr.s_addr = INADDR_ANY;
+    // Subscribers 4 and 5 share the work of all topics as members of one consumer group
+    for (int i = 3; i < NO_OF_SUBSCRIBERS; i++)
+    {
+        subscribers[i] = calloc(1, sizeof(Subscriber));
+        subscribers[i]->group = "enrichers/least-outstanding";
+        subscribers[i]->topic_count = 3;
+        subscribers[i]->topics[0] = "BBC";
+        subscribers[i]->topics[1] = "Reuters";
+        subscribers[i]->topics[2] = "CNN";
+    }
 
-    // Connect all subscribers to the broker
+    // Split every subscriber into one connection per broker owning some of its topics
     for (int i = 0; i < NO_OF_SUBSCRIBERS; i++)
     {
-        if (connect(subscribers[i]->sockfd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+        int first_connection = connection_count;
+        for (int t = 0; t < subscribers[i]->topic_count; t++)
         {
-            perror("Connection to broker failed");
-            return -1;
+            const BrokerAddress *owner = find_topic_owner(&partition_map, subscribers[i]->topics[t]);
+            Subscriber *connection = NULL;
+            for (int c = first_connection; c < connection_count; c++)
+            {
+                if (strcmp(connections[c]->host, owner->host) == 0 && connections[c]->port == owner->subscriber_port)
+                {
+                    connection = connections[c];
+                }
+            }
+            if (connection == NULL)
+            {
+                connection = new_connection(subscribers[i], owner->host, owner->subscriber_port);
+                connections[connection_count++] = connection;
+            }
+            add_topic(connection, subscribers[i]->topics[t]);
         }
-        printf("Subscriber %d connected to broker!\n", i + 1);
     }
 
-    // Create threads for each subscriber
-    for (int i = 0; i < NO_OF_SUBSCRIBERS; i++)
+    // Create threads for each connection, each one connects to its broker
+    for (int i = 0; i < connection_count; i++)
     {
-        pthread_create(&subscriber_threads[i], NULL, handle_subscriber, (void *)subscribers[i]);
+        pthread_create(&connection_threads[i], NULL, handle_subscriber, (void *)connections[i]);
     }
 
     // Wait for all subscriber threads to finish
-    for (int i = 0; i < NO_OF_SUBSCRIBERS; i++)
+    for (int i = 0; i < connection_count; i++)
     {
-        pthread_join(subscriber_threads[i], NULL);
+        pthread_join(connection_threads[i], NULL);
     }
 
     // Cleanup
+    for (int i = 0; i < connection_count; i++)
+    {
+        free(connections[i]);
+    }
     for (int i = 0; i < NO_OF_SUBSCRIBERS; i++)
     {
-        close(subscribers[i]->sockfd);
         free(subscribers[i]);
     }
 